@@ -2,6 +2,20 @@
 #include <stdio.h>
 #include <iostream>
 #include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <random>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 #include "lodepng.h"
 #include "Eigen/Core"
 #include "Eigen/Geometry"
@@ -11,8 +25,109 @@
 const int SCREEN_WIDTH = 950;
 const int SCREEN_HEIGHT = 600;
 
-// We store lines as 3x2 matrices (two 3D points)
-typedef Eigen::Matrix<float, 3, 2> Line3f;
+// Ranges shorter than this are not worth waking the worker threads for
+const int PARALLEL_GRAIN = 4096;
+
+// A fixed set of worker threads that is reused for every frame.
+// A job covers an index range [0, count) that gets cut into contiguous slices; every index belongs to exactly
+// one slice, so as long as a job only writes to the outputs of its own indices the result does not depend on
+// the number of threads or on the order in which the slices were picked up.
+typedef struct s_thread_pool {
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable work_ready;
+	std::condition_variable work_done;
+	const std::function<void(int, int)>* job = nullptr;
+	int job_count = 0;
+	int slice_count = 0;
+	int next_slice = 0;
+	int slices_finished = 0;
+	unsigned generation = 0; // bumped for every job, so late workers never pick up slices of a finished job
+	bool stopping = false;
+} t_thread_pool;
+
+t_thread_pool thread_pool;
+
+// grabs slices of the job with the given generation until none are left, the caller must not hold the mutex
+void thread_pool_run_slices(t_thread_pool& pool, unsigned generation) {
+	std::unique_lock<std::mutex> lock(pool.mutex);
+	while (pool.generation == generation && pool.next_slice < pool.slice_count) {
+		int slice = pool.next_slice++;
+		const std::function<void(int, int)>& job = *pool.job;
+		int begin = static_cast<int>(static_cast<long long>(pool.job_count) * slice / pool.slice_count);
+		int end = static_cast<int>(static_cast<long long>(pool.job_count) * (slice + 1) / pool.slice_count);
+
+		lock.unlock();
+		job(begin, end);
+		lock.lock();
+
+		if (++pool.slices_finished == pool.slice_count)
+			pool.work_done.notify_all();
+	}
+}
+
+void thread_pool_worker(t_thread_pool* pool) {
+	unsigned seen_generation = 0;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(pool->mutex);
+			pool->work_ready.wait(lock, [&] { return pool->stopping || pool->generation != seen_generation; });
+			if (pool->stopping)
+				return;
+			seen_generation = pool->generation;
+		}
+		thread_pool_run_slices(*pool, seen_generation);
+	}
+}
+
+// thread_count includes the calling thread, so 1 means everything runs inline
+void thread_pool_start(t_thread_pool& pool, int thread_count) {
+	for (int i = 1; i < thread_count; i++)
+		pool.workers.emplace_back(thread_pool_worker, &pool);
+}
+
+void thread_pool_stop(t_thread_pool& pool) {
+	{
+		std::lock_guard<std::mutex> lock(pool.mutex);
+		pool.stopping = true;
+	}
+	pool.work_ready.notify_all();
+	for (std::thread& worker : pool.workers)
+		worker.join();
+	pool.workers.clear();
+}
+
+// calls job(begin, end) on disjoint sub-ranges covering [0, count), blocks until all of them are done.
+// grain is the smallest range worth handing to another thread.
+// Not re-entrant: a job must not call parallel_for itself.
+void parallel_for(t_thread_pool& pool, int count, const std::function<void(int, int)>& job, int grain = PARALLEL_GRAIN) {
+	if (count <= 0)
+		return;
+	if (pool.workers.empty() || count < 2 * grain) {
+		job(0, count);
+		return;
+	}
+
+	unsigned generation;
+	{
+		std::lock_guard<std::mutex> lock(pool.mutex);
+		pool.job = &job;
+		pool.job_count = count;
+		// a few slices per thread so one slow slice does not hold up the whole frame
+		pool.slice_count = std::min(static_cast<int>(pool.workers.size() + 1) * 4, (count + grain - 1) / grain);
+		pool.next_slice = 0;
+		pool.slices_finished = 0;
+		generation = ++pool.generation;
+	}
+	pool.work_ready.notify_all();
+
+	// the calling thread helps out instead of just waiting
+	thread_pool_run_slices(pool, generation);
+
+	std::unique_lock<std::mutex> lock(pool.mutex);
+	pool.work_done.wait(lock, [&] { return pool.slices_finished == pool.slice_count; });
+	pool.job = nullptr;
+}
 
 typedef struct s_vertex3d {
 	Eigen::Vector3f position;
@@ -20,304 +135,3852 @@ typedef struct s_vertex3d {
 	SDL_Color color;
 } t_vertex3d;
 
-Eigen::Vector3f camera_position(1.0f, 1.0f, 1.0f);
+// A mesh vertex as it is stored, 8 bytes against t_vertex3d's 28: every mesh vertex is a heightmap sample, so its
+// place on the grid and its height are whole numbers. The mesh says where the samples are in world space, see
+// vertex_position; project_triangles goes straight from these to view space. The shade is not stored since the
+// light moves, it comes from the normal every frame.
+typedef struct s_packed_vertex {
+	uint16_t row, column; // heightmap sample
+	uint16_t height; // heightmap units
+	uint8_t normal[2]; // octahedral, see encode_normal
+} t_packed_vertex;
+
+// Octahedral normal: the unit sphere is folded onto the octahedron |x| + |y| + |z| = 1 and that is flattened onto
+// the square [-1, 1]^2, the lower half folding out into the corners. Errors stay under a degree or so at 8 bits.
+inline void encode_normal(const Eigen::Vector3f& normal, uint8_t code[2]) {
+	float length = abs(normal.x()) + abs(normal.y()) + abs(normal.z());
+	float x = normal.x() / length, y = normal.y() / length;
+	if (normal.z() < 0.0f) {
+		float folded_x = (1.0f - abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		y = (1.0f - abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = folded_x;
+	}
+	code[0] = static_cast<uint8_t>(std::lround((x * 0.5f + 0.5f) * 255.0f));
+	code[1] = static_cast<uint8_t>(std::lround((y * 0.5f + 0.5f) * 255.0f));
+}
+
+inline Eigen::Vector3f decode_normal(uint8_t code_x, uint8_t code_y) {
+	float x = code_x / 255.0f * 2.0f - 1.0f, y = code_y / 255.0f * 2.0f - 1.0f;
+	Eigen::Vector3f normal(x, y, 1.0f - abs(x) - abs(y));
+	float fold = std::max(-normal.z(), 0.0f);
+	normal.x() += normal.x() >= 0.0f ? -fold : fold;
+	normal.y() += normal.y() >= 0.0f ? -fold : fold;
+	return normal.normalized();
+}
+
+inline t_packed_vertex pack_vertex(int row, int column, int height, const Eigen::Vector3f& normal) {
+	t_packed_vertex vertex;
+	vertex.row = static_cast<uint16_t>(row);
+	vertex.column = static_cast<uint16_t>(column);
+	vertex.height = static_cast<uint16_t>(height);
+	encode_normal(normal, vertex.normal);
+	return vertex;
+}
+
+// number of heightmap quads along each side of a chunk
+const int CHUNK_SIZE = 32;
+
+// levels of detail of a chunk, level k keeps every 2^k-th heightmap sample; the coarsest still has two quads per side
+const int LOD_LEVELS = 5;
+
+// sides of a chunk, in the order of t_chunk::lod_strips
+typedef enum e_chunk_side {
+	SIDE_TOP, // first row
+	SIDE_BOTTOM, // last row
+	SIDE_LEFT, // first column
+	SIDE_RIGHT, // last column
+	SIDE_COUNT
+} t_chunk_side;
+
+// a run of triangles stored contiguously in the mesh
+typedef struct s_triangle_range {
+	int first, count;
+} t_triangle_range;
+
+// a square block of the terrain, its triangles are stored contiguously in the mesh so it can be culled as a whole
+// Quads are stored row by row within the chunk, two triangles each.
+typedef struct s_chunk {
+	int first_triangle;
+	int triangle_count;
+	int first_row, first_column; // of the quad grid
+	int rows, columns;
+	Eigen::AlignedBox3f bounds; // world space, spans the min/max heights of the chunk
+
+	// level of detail, built by build_chunk_levels: every level is an inside without the outermost ring of its quads,
+	// plus for every side one strip per level the neighbor on that side may be drawn at, which steps from this level's
+	// samples inside to the coarser of the two levels on the shared edge, so neighbors never leave a crack
+	int lod_max_level; // small chunks at the edge of the map do not have all levels
+	float lod_error[LOD_LEVELS]; // largest height difference between a level and the full heightmap, in world units before the exaggeration
+	t_triangle_range lod_inside[LOD_LEVELS];
+	t_triangle_range lod_strips[LOD_LEVELS][SIDE_COUNT][LOD_LEVELS]; // [level][side][edge level], edge level >= level
+} t_chunk;
+
+typedef struct s_mesh {
+	std::vector<t_packed_vertex> verticies; // three per triangle, the full grid first and the levels of detail after it
+	std::vector<t_chunk> chunks; // row by row, chunk_columns per row
+	int rows, columns; // size of the quad grid
+	int chunk_columns; // 0 if the triangles are not the grid's quads, see rtin_mesh
+	Eigen::Vector2f grid_origin; // world x/y of the first heightmap pixel
+	Eigen::Vector2f cell_size; // world x/y size of one quad
+	float height_scale; // world z of one heightmap unit, before the vertical exaggeration
+	bool has_levels; // whether build_chunk_levels ran
+} t_mesh;
+
+// the world z of one heightmap unit everywhere, before the vertical exaggeration
+const float HEIGHT_SCALE = 0.2f / 255.0f;
+
+inline Eigen::Vector3f vertex_position(const t_mesh& mesh, const t_packed_vertex& vertex) {
+	return Eigen::Vector3f(mesh.grid_origin.x() + vertex.row * mesh.cell_size.x(), mesh.grid_origin.y() + vertex.column * mesh.cell_size.y(), vertex.height * mesh.height_scale);
+}
+
+// empties the mesh for triangles over a heightmap of rows x columns samples, with chunk_columns 0 like every mesh but
+// the grid's
+void reset_mesh(t_mesh& mesh, int rows, int columns) {
+	mesh.verticies.clear();
+	mesh.chunks.clear();
+	mesh.rows = rows - 1;
+	mesh.columns = columns - 1;
+	mesh.chunk_columns = 0;
+	mesh.grid_origin = Eigen::Vector2f(-0.5f, -0.5f); // matches initialize_vertex
+	mesh.cell_size = Eigen::Vector2f(1.0f / rows, 1.0f / columns);
+	mesh.height_scale = HEIGHT_SCALE;
+	mesh.has_levels = false;
+}
+
+// starts a chunk of the triangles pushed to the mesh from now on, until close_chunk
+void open_chunk(t_mesh& mesh) {
+	t_chunk chunk = {};
+	chunk.first_triangle = static_cast<int>(mesh.verticies.size() / 3);
+	chunk.lod_max_level = -1;
+	chunk.bounds.setEmpty();
+	mesh.chunks.push_back(chunk);
+}
+
+// counts and bounds the triangles of the last chunk, which is dropped if it has none
+void close_chunk(t_mesh& mesh) {
+	t_chunk& chunk = mesh.chunks.back();
+	chunk.triangle_count = static_cast<int>(mesh.verticies.size() / 3) - chunk.first_triangle;
+	for (int k = 3 * chunk.first_triangle; k < static_cast<int>(mesh.verticies.size()); k++)
+		chunk.bounds.extend(vertex_position(mesh, mesh.verticies[k]));
+	if (chunk.triangle_count == 0)
+		mesh.chunks.pop_back();
+}
+
+Eigen::Vector3f camera_position(1.0f, 1.0f, 1.0f);
+
+float perspective_factor = camera_position.norm();
+
+// sunlight simulation
+Eigen::Vector3f light_direction(0.0f, 0.0f, -1.0f); // pointing straight down
+
+// Stretches every height by this factor on its way to view space, nothing is rebuilt when it changes. Everything is
+// built at 1 and kept that way: meshes store heightmap units, and normals the slopes at 1, see exaggerate_normal.
+float vertical_exaggeration{ 1.0f };
+const float EXAGGERATION_STEP = 1.25f; // factor of one key press
+
+// drop triangles that face away from the camera, the terrain has no underside worth drawing
+bool backface_culling{ true };
+
+// how the shaded view gets its pixels
+typedef enum e_render_backend {
+	BACKEND_SDL_GEOMETRY, // painter's algorithm through SDL_RenderGeometry
+	BACKEND_SOFTWARE, // our own z-buffer rasterizer, no sorting needed
+	BACKEND_VOXEL_SPACE, // column raycaster straight over the heightmap, no triangles at all
+	BACKEND_RAY_TRACE, // exact per pixel rays against the mesh surface through a max mipmap, with sun shadows
+	BACKEND_COUNT
+} t_render_backend;
+
+t_render_backend render_backend{ BACKEND_SDL_GEOMETRY };
+
+inline bool backend_draws_triangles(t_render_backend backend) {
+	return backend == BACKEND_SDL_GEOMETRY || backend == BACKEND_SOFTWARE;
+}
+
+// how the painter's algorithm gets its back to front order
+typedef enum e_sort_mode {
+	SORT_DEPTH, // sort the triangles by depth
+	SORT_GRID, // walk the heightmap grid from the far side towards the camera, no sorting needed
+	SORT_INCREMENTAL, // repair last frame's depth order, which barely changes while the camera moves in small steps
+	SORT_MODE_COUNT
+} t_sort_mode;
+
+t_sort_mode sort_mode{ SORT_GRID };
+
+// skip triangles hidden behind terrain that is already drawn, see horizon_cull
+bool horizon_culling{ false };
+
+// darken the triangle edges while shading, software backend only, see rasterize_triangle
+bool edge_overlay{ false };
+
+// draw every chunk at the coarsest level of detail that looks the same, see select_chunk_levels
+bool level_of_detail{ false };
+
+// draw the adaptive mesh cut from the right-triangulated irregular network instead of the grid, see rtin_mesh
+bool adaptive_mesh{ false };
+float adaptive_mesh_error{ 2.0f }; // tolerance in heightmap units
+const float ADAPTIVE_MESH_ERROR_STEP = 1.5f; // factor of one key press
+const float ADAPTIVE_MESH_MIN_ERROR = 0.25f; // one step below this is the exact mesh
+
+// draw the rings of the geometry clipmap around the camera instead of the whole map, see update_clipmap
+bool clipmap_terrain{ false };
+
+SDL_Color shade(const Eigen::Vector3f& normal) {
+	Uint8 val = static_cast<Uint8>(abs(normal.dot(light_direction)) * 255);
+
+	return SDL_Color{ val , val , val , 0xFF };
+}
+
+void compute_color(t_vertex3d& v) {
+	v.color = shade(v.normal);
+}
+
+// the normal of the surface with its heights stretched by exaggeration, given the normal at 1: the slopes stretch
+// with the heights, so the normal's x and y do too
+inline Eigen::Vector3f exaggerate_normal(const Eigen::Vector3f& normal, float exaggeration) {
+	return Eigen::Vector3f(normal.x() * exaggeration, normal.y() * exaggeration, normal.z()).normalized();
+}
+
+void set_heightmap_normal(int** heightmap, int i, int j, int width, int height, Eigen::Vector3f &normal) {
+	int num_normals = 0;
+	normal.x() = normal.y() = normal.z() = 0;
+	// normal of line above
+	float delta_vertical { 0.0f };
+	float delta_horizontal { 0.0f };
+	float current = heightmap[i][j] / 255.0f;
+	
+	if (i - 1 >= 0) // up
+		delta_vertical += current - heightmap[i - 1][j] / 255.0f;
+	if (i + 1 < height) // down
+		delta_vertical += heightmap[i + 1][j] / 255.0f - current;
+	if (j - 1 >= 0) // left
+		delta_horizontal += heightmap[i][j - 1] / 255.0f - current;
+	if (i + 1 < width) // right
+		delta_horizontal += current - heightmap[i][j + 1] / 255.0f;
+
+	// create tangent space vectors so we can compute normal of vertex
+	// note that each vertex corresponds to one pixel in the given heightmap
+	Eigen::Vector3f tangent_vertical(2.0f / height, 0.0f, delta_vertical);
+	Eigen::Vector3f tangent_horizontal(0.0f, 2.0f / width, delta_horizontal);
+	normal = tangent_vertical.cross(tangent_horizontal);
+	normal.normalize();
+}
+
+void initialize_vertex(int i, int j, int** heightmap, int width, int height, t_vertex3d& vertex) {
+	Eigen::Vector3f pos(i, j, HEIGHT_SCALE * heightmap[i][j]);
+	
+	vertex.position << pos;
+	vertex.position.x() = vertex.position.x() / height - 0.5f; // the substraction centers the heightmap plane on the x and y -axes
+	vertex.position.y() = vertex.position.y() / width - 0.5f;
+	
+	set_heightmap_normal(heightmap, i, j, width, height, vertex.normal);
+	compute_color(vertex);
+}
+
+// the packed mesh vertex of heightmap sample (i, j), see initialize_vertex
+inline t_packed_vertex sample_vertex(int i, int j, int** heightmap, int width, int height) {
+	Eigen::Vector3f normal;
+	set_heightmap_normal(heightmap, i, j, width, height, normal);
+	return pack_vertex(i, j, heightmap[i][j], normal);
+}
+
+// creates a strip of triangles, grouped into chunks of CHUNK_SIZE x CHUNK_SIZE quads
+void tris_from_heightmap(int** heightmap, int width, int height, t_mesh& mesh) {
+	std::vector<t_packed_vertex>& triangle_points = mesh.verticies;
+	reset_mesh(mesh, height, width);
+	mesh.chunk_columns = (mesh.columns + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+	for (int chunk_i = 1; chunk_i < height; chunk_i += CHUNK_SIZE)
+	{
+		for (int chunk_j = 1; chunk_j < width; chunk_j += CHUNK_SIZE)
+		{
+			open_chunk(mesh); // its levels of detail are set by build_chunk_levels
+			t_chunk& chunk = mesh.chunks.back();
+			chunk.first_row = chunk_i - 1;
+			chunk.first_column = chunk_j - 1;
+			chunk.rows = std::min(chunk_i + CHUNK_SIZE, height) - chunk_i;
+			chunk.columns = std::min(chunk_j + CHUNK_SIZE, width) - chunk_j;
+
+			for (int i = chunk_i; i < std::min(chunk_i + CHUNK_SIZE, height); i++)
+			{
+				for (int j = chunk_j; j < std::min(chunk_j + CHUNK_SIZE, width); j++)
+				{
+					// four points corresponding to the quad of the heightmap we are currently processing
+					t_packed_vertex v[4] = {
+						sample_vertex(i - 1, j - 1, heightmap, width, height),
+						sample_vertex(i - 1, j, heightmap, width, height),
+						sample_vertex(i, j - 1, heightmap, width, height),
+						sample_vertex(i, j, heightmap, width, height)
+					};
+
+					// triangle 1
+					triangle_points.push_back(v[0]);
+					triangle_points.push_back(v[1]);
+					triangle_points.push_back(v[2]);
+
+					// triangle 2, wound the same way as triangle 1 so backfaces can be told apart on screen
+					triangle_points.push_back(v[1]);
+					triangle_points.push_back(v[3]);
+					triangle_points.push_back(v[2]);
+				}
+			}
+
+			close_chunk(mesh);
+		}
+	}
+}
+
+// sample offsets along a chunk side of the given number of quads at a level: every 2^level-th one and always the last
+std::vector<int> level_samples(int length, int level) {
+	std::vector<int> samples;
+	for (int k = 0; k < length; k += 1 << level)
+		samples.push_back(k);
+	samples.push_back(length);
+	return samples;
+}
+
+// twice the signed area of triangle a, b, c over (row, column), the grid's triangles have a negative one
+inline long long sample_area(const Eigen::Vector2i& a, const Eigen::Vector2i& b, const Eigen::Vector2i& c) {
+	return static_cast<long long>(b.x() - a.x()) * (c.y() - a.y()) - static_cast<long long>(b.y() - a.y()) * (c.x() - a.x());
+}
+
+// appends the triangle between three samples of the chunk (row, column offsets), wound like the full grid's
+void push_sample_triangle(int** heightmap, int width, int height, const t_chunk& chunk, Eigen::Vector2i a, Eigen::Vector2i b, Eigen::Vector2i c, std::vector<t_packed_vertex>& verticies) {
+	long long area = sample_area(a, b, c);
+	if (area == 0)
+		return;
+	if (area > 0)
+		std::swap(b, c);
+	for (const Eigen::Vector2i& sample : { a, b, c })
+		verticies.push_back(sample_vertex(chunk.first_row + sample.x(), chunk.first_column + sample.y(), heightmap, width, height));
+}
+
+// triangulates the band between two runs of samples along the same side, both ordered along coordinate axis, and
+// hands every triangle to push
+void zip_sample_strip(const std::vector<Eigen::Vector2i>& outer, const std::vector<Eigen::Vector2i>& inner, int axis, const std::function<void(const Eigen::Vector2i&, const Eigen::Vector2i&, const Eigen::Vector2i&)>& push) {
+	size_t o = 0, i = 0;
+	while (o + 1 < outer.size() || i + 1 < inner.size()) {
+		if (i + 1 == inner.size() || (o + 1 < outer.size() && outer[o + 1][axis] <= inner[i + 1][axis])) {
+			push(outer[o], inner[i], outer[o + 1]);
+			o++;
+		} else {
+			push(outer[o], inner[i], inner[i + 1]);
+			i++;
+		}
+	}
+}
+
+// the strip between two runs of samples along the same side of a chunk
+void push_sample_strip(int** heightmap, int width, int height, const t_chunk& chunk, const std::vector<Eigen::Vector2i>& outer, const std::vector<Eigen::Vector2i>& inner, int axis, std::vector<t_packed_vertex>& verticies) {
+	zip_sample_strip(outer, inner, axis, [&](const Eigen::Vector2i& a, const Eigen::Vector2i& b, const Eigen::Vector2i& c) {
+		push_sample_triangle(heightmap, width, height, chunk, a, b, c, verticies);
+	});
+}
+
+// Geomipmapping: appends every level of detail of every chunk to the mesh, see t_chunk. A level's error is measured
+// over all the chunk's samples against its quads split like the full grid, the strips are not measured separately.
+void build_chunk_levels(int** heightmap, int width, int height, t_mesh& mesh) {
+	std::vector<t_packed_vertex>& verticies = mesh.verticies;
+	for (t_chunk& chunk : mesh.chunks) {
+		auto sample_height = [&](int row, int column) { return HEIGHT_SCALE * heightmap[chunk.first_row + row][chunk.first_column + column]; };
+		auto triangles_since = [&](int first) { return t_triangle_range{ first, static_cast<int>(verticies.size() / 3) - first }; };
+
+		chunk.lod_max_level = -1;
+		for (int level = 0; level < LOD_LEVELS; level++) {
+			std::vector<int> rows = level_samples(chunk.rows, level), columns = level_samples(chunk.columns, level);
+			if (rows.size() < 3 || columns.size() < 3)
+				break; // no inside left
+			chunk.lod_max_level = level;
+
+			int first = static_cast<int>(verticies.size() / 3);
+			for (size_t r = 1; r + 2 < rows.size(); r++) {
+				for (size_t c = 1; c + 2 < columns.size(); c++) {
+					Eigen::Vector2i v0(rows[r], columns[c]), v1(rows[r], columns[c + 1]), v2(rows[r + 1], columns[c]), v3(rows[r + 1], columns[c + 1]);
+					push_sample_triangle(heightmap, width, height, chunk, v0, v1, v2, verticies);
+					push_sample_triangle(heightmap, width, height, chunk, v1, v3, v2, verticies);
+				}
+			}
+			chunk.lod_inside[level] = triangles_since(first);
+
+			for (int edge_level = 0; edge_level < LOD_LEVELS; edge_level++) {
+				for (int side = 0; side < SIDE_COUNT; side++) {
+					// the samples on the shared edge and the first ones inside, which belong to this level
+					bool along_rows = side == SIDE_TOP || side == SIDE_BOTTOM;
+					int edge = side == SIDE_TOP || side == SIDE_LEFT ? 0 : (along_rows ? chunk.rows : chunk.columns);
+					const std::vector<int>& across = along_rows ? rows : columns;
+					int inside = side == SIDE_TOP || side == SIDE_LEFT ? across[1] : across[across.size() - 2];
+					const std::vector<int>& along = along_rows ? columns : rows;
+
+					std::vector<Eigen::Vector2i> outer, inner;
+					for (int k : level_samples(along_rows ? chunk.columns : chunk.rows, edge_level))
+						outer.push_back(along_rows ? Eigen::Vector2i(edge, k) : Eigen::Vector2i(k, edge));
+					for (size_t k = 1; k + 1 < along.size(); k++)
+						inner.push_back(along_rows ? Eigen::Vector2i(inside, along[k]) : Eigen::Vector2i(along[k], inside));
+
+					first = static_cast<int>(verticies.size() / 3);
+					push_sample_strip(heightmap, width, height, chunk, outer, inner, along_rows ? 1 : 0, verticies);
+					chunk.lod_strips[level][side][edge_level] = triangles_since(first);
+				}
+			}
+
+			float error = level > 0 ? chunk.lod_error[level - 1] : 0.0f; // never less than a finer level's
+			for (size_t r = 0; r + 1 < rows.size(); r++) {
+				for (size_t c = 0; c + 1 < columns.size(); c++) {
+					float h00 = sample_height(rows[r], columns[c]), h01 = sample_height(rows[r], columns[c + 1]);
+					float h10 = sample_height(rows[r + 1], columns[c]), h11 = sample_height(rows[r + 1], columns[c + 1]);
+					for (int i = rows[r]; i <= rows[r + 1]; i++) {
+						for (int j = columns[c]; j <= columns[c + 1]; j++) {
+							float u = static_cast<float>(i - rows[r]) / (rows[r + 1] - rows[r]);
+							float v = static_cast<float>(j - columns[c]) / (columns[c + 1] - columns[c]);
+							// the quad's diagonal runs from (r, c + 1) to (r + 1, c)
+							float surface = u + v <= 1.0f ? h00 + u * (h10 - h00) + v * (h01 - h00) : h11 + (1.0f - u) * (h01 - h11) + (1.0f - v) * (h10 - h11);
+							error = std::max(error, abs(surface - sample_height(i, j)));
+						}
+					}
+				}
+			}
+			chunk.lod_error[level] = error;
+		}
+	}
+	mesh.has_levels = true;
+}
+
+// Right-triangulated irregular network over a square grid of 2^k + 1 samples. Every triangle is right isosceles and
+// splits at the midpoint of its hypotenuse into two smaller ones; errors holds, per sample, the largest height error
+// of any triangle that would have to split at it. A triangle's error includes its children's, so a mesh cut at any
+// tolerance has no cracks. Maps that are not 2^k + 1 samples wide are padded with their edge, see rtin_mesh.
+typedef struct s_rtin {
+	int size; // samples per side
+	int rows, columns; // of the heightmap
+	std::vector<float> errors; // size * size, row major, in heightmap units
+} t_rtin;
+
+// the heightmap sample at (row, column) of the grid, the padding repeats the edge
+inline int rtin_height(int** heightmap, const t_rtin& rtin, int row, int column) {
+	return heightmap[std::min(row, rtin.rows - 1)][std::min(column, rtin.columns - 1)];
+}
+
+// corners of triangle i of the implicit tree, a and b end the hypotenuse and c is the right angle. Points are
+// (row, column). Triangles are numbered level by level, i = 0 and 1 are the two halves of the grid, so every
+// triangle's number is below its children's.
+inline void rtin_triangle(int size, int i, Eigen::Vector2i& a, Eigen::Vector2i& b, Eigen::Vector2i& c) {
+	int last = size - 1;
+	int id = i + 2;
+	if (id & 1) {
+		a = Eigen::Vector2i(0, 0);
+		b = Eigen::Vector2i(last, last);
+		c = Eigen::Vector2i(last, 0);
+	} else {
+		a = Eigen::Vector2i(last, last);
+		b = Eigen::Vector2i(0, 0);
+		c = Eigen::Vector2i(0, last);
+	}
+	// the lowest bit picked the half, the following ones pick the left or right child on the way down
+	while ((id >>= 1) > 1) {
+		Eigen::Vector2i middle = (a + b) / 2;
+		if (id & 1) {
+			b = a;
+			a = c;
+		} else {
+			a = b;
+			b = c;
+		}
+		c = middle;
+	}
+}
+
+// Fills the error of every sample, walking the triangles from the smallest up so children are done before parents.
+void build_rtin(int** heightmap, int width, int height, t_rtin& rtin) {
+	rtin.rows = height;
+	rtin.columns = width;
+	rtin.size = 2;
+	while (rtin.size - 1 < std::max(width, height) - 1)
+		rtin.size = 2 * (rtin.size - 1) + 1;
+	int size = rtin.size, tile = size - 1;
+	rtin.errors.assign(static_cast<size_t>(size) * size, 0.0f);
+
+	// triangles with legs of one cell have no midpoint and no error
+	int triangle_count = 2 * tile * tile - 2;
+	int parent_count = triangle_count - tile * tile;
+	for (int i = triangle_count - 1; i >= 0; i--) {
+		Eigen::Vector2i a, b, c;
+		rtin_triangle(size, i, a, b, c);
+		Eigen::Vector2i middle = (a + b) / 2;
+		float interpolated = (rtin_height(heightmap, rtin, a.x(), a.y()) + rtin_height(heightmap, rtin, b.x(), b.y())) / 2.0f;
+		float& error = rtin.errors[static_cast<size_t>(middle.x()) * size + middle.y()];
+		error = std::max(error, abs(interpolated - rtin_height(heightmap, rtin, middle.x(), middle.y())));
+		if (i < parent_count) {
+			// the children split at the midpoints of a-c and b-c
+			Eigen::Vector2i left = (a + c) / 2, right = (b + c) / 2;
+			error = std::max({ error, rtin.errors[static_cast<size_t>(left.x()) * size + left.y()], rtin.errors[static_cast<size_t>(right.x()) * size + right.y()] });
+		}
+	}
+}
+
+// state of one rtin_mesh extraction
+typedef struct s_rtin_extraction {
+	int** heightmap;
+	const t_rtin* rtin;
+	float max_error;
+	int chunk_depth; // the subtrees at this depth become the chunks of the mesh
+	t_mesh* mesh;
+} t_rtin_extraction;
+
+t_packed_vertex rtin_vertex(const t_rtin_extraction& extraction, const Eigen::Vector2i& sample) {
+	const t_rtin& rtin = *extraction.rtin;
+	t_packed_vertex vertex = sample_vertex(std::min(sample.x(), rtin.rows - 1), std::min(sample.y(), rtin.columns - 1), extraction.heightmap, rtin.columns, rtin.rows);
+	// the padding keeps its place on the grid, only its height is the edge's
+	vertex.row = static_cast<uint16_t>(sample.x());
+	vertex.column = static_cast<uint16_t>(sample.y());
+	return vertex;
+}
+
+// splits the triangle while its error is above the tolerance, so the work is linear in the triangles it emits
+void rtin_split(t_rtin_extraction& extraction, const Eigen::Vector2i& a, const Eigen::Vector2i& b, const Eigen::Vector2i& c, int depth) {
+	const t_rtin& rtin = *extraction.rtin;
+	t_mesh& mesh = *extraction.mesh;
+	Eigen::Vector2i middle = (a + b) / 2;
+	bool split = (a - c).cwiseAbs().sum() > 1 && rtin.errors[static_cast<size_t>(middle.x()) * rtin.size + middle.y()] > extraction.max_error;
+
+	// a leaf above the chunk depth is a chunk on its own
+	bool opens_chunk = depth == extraction.chunk_depth || (depth < extraction.chunk_depth && !split);
+	if (opens_chunk)
+		open_chunk(mesh);
+
+	if (split) {
+		rtin_split(extraction, c, a, middle, depth + 1);
+		rtin_split(extraction, b, c, middle, depth + 1);
+	} else if (std::min({ a.x(), b.x(), c.x() }) < rtin.rows && std::min({ a.y(), b.y(), c.y() }) < rtin.columns) {
+		// a, b, c winds like the full grid's triangles; triangles entirely in the padding are dropped
+		for (const Eigen::Vector2i* sample : { &a, &b, &c })
+			mesh.verticies.push_back(rtin_vertex(extraction, *sample));
+	}
+
+	if (opens_chunk)
+		close_chunk(mesh);
+}
+
+// Cuts the network at the given tolerance (heightmap units) into a mesh. Flat ground stays a few large triangles.
+// The chunks are subtrees of about CHUNK_SIZE x CHUNK_SIZE cells, so frustum culling works as on the full grid, but
+// they are not laid out as a grid, so the grid order does not apply.
+void rtin_mesh(int** heightmap, const t_rtin& rtin, float max_error, t_mesh& mesh) {
+	reset_mesh(mesh, rtin.rows, rtin.columns);
+
+	// every level of the tree halves the area, the two roots are half of the grid each
+	int cells = (rtin.size - 1) * (rtin.size - 1);
+	int chunk_depth = 0;
+	while ((cells >> (chunk_depth + 1)) > CHUNK_SIZE * CHUNK_SIZE)
+		chunk_depth++;
+
+	t_rtin_extraction extraction{ heightmap, &rtin, max_error, chunk_depth, &mesh };
+	int last = rtin.size - 1;
+	rtin_split(extraction, Eigen::Vector2i(0, 0), Eigen::Vector2i(last, last), Eigen::Vector2i(last, 0), 0);
+	rtin_split(extraction, Eigen::Vector2i(last, last), Eigen::Vector2i(0, 0), Eigen::Vector2i(0, last), 0);
+}
+
+// Geometry clipmap: CLIPMAP_LEVELS nested square grids of CLIPMAP_SIZE x CLIPMAP_SIZE samples centered below the
+// camera, level k keeping every 2^k-th heightmap sample, so the terrain gets coarser with the distance to the camera.
+// Levels are stored toroidally: when the camera moves, only the rows and columns that come into range are read from
+// the source, so the memory and the work of a frame are the same however large the terrain is.
+const int CLIPMAP_SIZE = 65; // odd, so the border of a level falls on the samples of the next one
+const int CLIPMAP_LEVELS = 5;
+
+// where the clipmap reads its heights from, one sample at a time, so they could as well be paged in from disk
+typedef struct s_height_source {
+	int** heightmap;
+	int width, height;
+} t_height_source;
+
+// in heightmap units, samples outside the map repeat its edge
+inline float source_sample(const t_height_source& source, int row, int column) {
+	return static_cast<float>(source.heightmap[std::clamp(row, 0, source.height - 1)][std::clamp(column, 0, source.width - 1)]);
+}
+
+typedef struct s_clipmap_level {
+	int spacing; // heightmap samples between two of the level's
+	int origin_row, origin_column; // heightmap sample of the level's first row and column, multiples of 2 * spacing
+	bool filled; // false until the first update
+	// CLIPMAP_SIZE x CLIPMAP_SIZE, heightmap sample (row, column) is kept at [row / spacing][column / spacing], both
+	// wrapped around the size
+	std::vector<uint16_t> heights; // heightmap units
+	std::vector<Eigen::Vector3f> normals;
+} t_clipmap_level;
+
+typedef struct s_clipmap {
+	t_height_source source;
+	t_clipmap_level levels[CLIPMAP_LEVELS];
+	t_mesh mesh; // of the last update
+} t_clipmap;
+
+void build_clipmap(int** heightmap, int width, int height, t_clipmap& clipmap) {
+	clipmap.source = t_height_source{ heightmap, width, height };
+	for (int k = 0; k < CLIPMAP_LEVELS; k++) {
+		t_clipmap_level& level = clipmap.levels[k];
+		level.spacing = 1 << k;
+		level.origin_row = level.origin_column = 0;
+		level.filled = false;
+		level.heights.assign(CLIPMAP_SIZE * CLIPMAP_SIZE, 0);
+		level.normals.assign(CLIPMAP_SIZE * CLIPMAP_SIZE, Eigen::Vector3f::Zero());
+	}
+}
+
+// row and column count the level's samples from the heightmap's first one
+inline int clipmap_index(int row, int column) {
+	int r = row % CLIPMAP_SIZE, c = column % CLIPMAP_SIZE;
+	return (r < 0 ? r + CLIPMAP_SIZE : r) * CLIPMAP_SIZE + (c < 0 ? c + CLIPMAP_SIZE : c);
+}
+
+// reads one sample of the level and its normal, which is set_heightmap_normal's over the level's spacing
+void refresh_clipmap_sample(const t_clipmap& clipmap, t_clipmap_level& level, int row, int column) {
+	const t_height_source& source = clipmap.source;
+	int s = level.spacing, i = row * s, j = column * s;
+	float delta_vertical = (source_sample(source, i + s, j) - source_sample(source, i - s, j)) / 255.0f;
+	float delta_horizontal = (source_sample(source, i, j - s) - source_sample(source, i, j + s)) / 255.0f;
+	Eigen::Vector3f tangent_vertical(2.0f * s / source.height, 0.0f, delta_vertical);
+	Eigen::Vector3f tangent_horizontal(0.0f, 2.0f * s / source.width, delta_horizontal);
+
+	int index = clipmap_index(row, column);
+	level.heights[index] = static_cast<uint16_t>(source_sample(source, i, j));
+	level.normals[index] = tangent_vertical.cross(tangent_horizontal).normalized();
+}
+
+// the largest multiple of step that is not above value
+inline int floor_to_multiple(int value, int step) {
+	return (value >= 0 ? value / step : -((-value + step - 1) / step)) * step;
+}
+
+// moves the level to its new origin, reading only the rows and columns that were not in range before
+void update_clipmap_level(t_clipmap& clipmap, t_clipmap_level& level, int origin_row, int origin_column) {
+	const int n = CLIPMAP_SIZE;
+	int first_row = origin_row / level.spacing, first_column = origin_column / level.spacing;
+	int shift_rows = first_row - level.origin_row / level.spacing, shift_columns = first_column - level.origin_column / level.spacing;
+	bool everything = !level.filled || abs(shift_rows) >= n || abs(shift_columns) >= n;
+	level.origin_row = origin_row;
+	level.origin_column = origin_column;
+	level.filled = true;
+
+	// the new rows are read whole, the new columns only where they cross the old rows
+	int rows_begin = everything ? 0 : (shift_rows > 0 ? n - shift_rows : 0);
+	int rows_end = everything ? n : (shift_rows > 0 ? n : -shift_rows);
+	int columns_begin = everything ? 0 : (shift_columns > 0 ? n - shift_columns : 0);
+	int columns_end = everything ? 0 : (shift_columns > 0 ? n : -shift_columns);
+	for (int r = rows_begin; r < rows_end; r++)
+		for (int c = 0; c < n; c++)
+			refresh_clipmap_sample(clipmap, level, first_row + r, first_column + c);
+	for (int r = 0; r < n; r++) {
+		if (r >= rows_begin && r < rows_end)
+			continue;
+		for (int c = columns_begin; c < columns_end; c++)
+			refresh_clipmap_sample(clipmap, level, first_row + r, first_column + c);
+	}
+}
+
+// Centers the levels on the ground point below the camera and cuts them into the mesh. Every level but the coarsest
+// leaves out the outermost ring of its quads and steps from its samples inside to every other sample on its border,
+// which are the next level's, and every level but the finest has a hole where the finer one is, so there are no
+// cracks. Parts beyond the heightmap are flattened onto its edge and dropped.
+void update_clipmap(t_clipmap& clipmap, const Eigen::Vector3f& camera) {
+	const t_height_source& source = clipmap.source;
+	const int n = CLIPMAP_SIZE;
+	int center_row = static_cast<int>(std::floor((camera.x() + 0.5f) * source.height)); // inverse of initialize_vertex
+	int center_column = static_cast<int>(std::floor((camera.y() + 0.5f) * source.width));
+	for (t_clipmap_level& level : clipmap.levels) {
+		int half = (n - 1) / 2 * level.spacing;
+		update_clipmap_level(clipmap, level, floor_to_multiple(center_row - half, 2 * level.spacing), floor_to_multiple(center_column - half, 2 * level.spacing));
+	}
+
+	t_mesh& mesh = clipmap.mesh;
+	reset_mesh(mesh, source.height, source.width);
+
+	for (int k = 0; k < CLIPMAP_LEVELS; k++) {
+		const t_clipmap_level& level = clipmap.levels[k];
+		int first_row = level.origin_row / level.spacing, first_column = level.origin_column / level.spacing;
+		bool stitched = k + 1 < CLIPMAP_LEVELS;
+
+		// the quads the finer level covers, in this level's samples from its origin
+		int hole_row = 0, hole_column = 0, hole_size = 0;
+		if (k > 0) {
+			hole_row = clipmap.levels[k - 1].origin_row / level.spacing - first_row;
+			hole_column = clipmap.levels[k - 1].origin_column / level.spacing - first_column;
+			hole_size = (n - 1) / 2;
+		}
+
+		// a, b, c are samples of the level from its origin, wound like the full grid's triangles
+		auto push = [&](const Eigen::Vector2i& a, const Eigen::Vector2i& b, const Eigen::Vector2i& c) {
+			Eigen::Vector2i corners[3] = { a, b, c };
+			Eigen::Vector2i clamped[3];
+			for (int v = 0; v < 3; v++)
+				clamped[v] = Eigen::Vector2i(std::clamp((first_row + corners[v].x()) * level.spacing, 0, source.height - 1), std::clamp((first_column + corners[v].y()) * level.spacing, 0, source.width - 1));
+			long long area = sample_area(clamped[0], clamped[1], clamped[2]);
+			if (area == 0)
+				return;
+			if (area > 0) {
+				std::swap(corners[1], corners[2]);
+				std::swap(clamped[1], clamped[2]);
+			}
+			for (int v = 0; v < 3; v++) {
+				int index = clipmap_index(first_row + corners[v].x(), first_column + corners[v].y());
+				mesh.verticies.push_back(pack_vertex(clamped[v].x(), clamped[v].y(), level.heights[index], level.normals[index]));
+			}
+		};
+
+		for (int chunk_row = 0; chunk_row < n - 1; chunk_row += CHUNK_SIZE) {
+			for (int chunk_column = 0; chunk_column < n - 1; chunk_column += CHUNK_SIZE) {
+				open_chunk(mesh);
+				for (int r = chunk_row; r < std::min(chunk_row + CHUNK_SIZE, n - 1); r++) {
+					for (int c = chunk_column; c < std::min(chunk_column + CHUNK_SIZE, n - 1); c++) {
+						if (stitched && (r == 0 || c == 0 || r == n - 2 || c == n - 2))
+							continue;
+						if (r >= hole_row && r < hole_row + hole_size && c >= hole_column && c < hole_column + hole_size)
+							continue;
+						Eigen::Vector2i v0(r, c), v1(r, c + 1), v2(r + 1, c), v3(r + 1, c + 1);
+						push(v0, v1, v2);
+						push(v1, v3, v2);
+					}
+				}
+				close_chunk(mesh);
+			}
+		}
+
+		if (stitched) {
+			open_chunk(mesh);
+			for (int side = 0; side < SIDE_COUNT; side++) {
+				bool along_rows = side == SIDE_TOP || side == SIDE_BOTTOM;
+				int edge = side == SIDE_TOP || side == SIDE_LEFT ? 0 : n - 1;
+				int inside = side == SIDE_TOP || side == SIDE_LEFT ? 1 : n - 2;
+				std::vector<Eigen::Vector2i> outer, inner;
+				for (int j = 0; j < n; j += 2)
+					outer.push_back(along_rows ? Eigen::Vector2i(edge, j) : Eigen::Vector2i(j, edge));
+				for (int j = 1; j < n - 1; j++)
+					inner.push_back(along_rows ? Eigen::Vector2i(inside, j) : Eigen::Vector2i(j, inside));
+				zip_sample_strip(outer, inner, along_rows ? 1 : 0, push);
+			}
+			close_chunk(mesh);
+		}
+	}
+}
+
+// Triangulated irregular network: a Delaunay triangulation of the few heightmap samples that keep the surface within
+// a tolerance, built offline by build_tin and stored with save_tin. Points are (row, column) of the heightmap it was
+// built from, triangles are three point indices each.
+typedef struct s_tin {
+	int rows, columns; // of the heightmap
+	std::vector<Eigen::Vector2i> points;
+	std::vector<int> heights; // per point, in heightmap units
+	std::vector<int> triangles;
+} t_tin;
+
+// Greedy insertion (Garland and Heckbert): every triangle knows the sample inside it that is furthest from its plane,
+// a heap hands out the triangle with the largest such error, whose sample gets inserted and the triangulation is made
+// Delaunay again by flipping edges. Only the triangles that changed are searched for their new candidates.
+typedef struct s_tin_builder {
+	int** heightmap;
+	std::vector<Eigen::Vector2i> points; // (row, column)
+	std::vector<int> triangles; // three points each, counterclockwise with x = column and y = row
+	std::vector<int> halfedges; // per triangle edge the same edge of the neighbor, -1 on the border of the map
+	std::vector<Eigen::Vector2i> candidates; // per triangle, the sample with the largest error
+	std::vector<int> queue_indices; // per triangle, where it is in queue, -1 if it is not
+	std::vector<int> queue; // heap of triangles, largest error first
+	std::vector<float> errors; // parallel to queue
+	std::vector<int> pending; // triangles whose candidate is not known yet
+} t_tin_builder;
+
+// twice the signed area of triangle (a, b, c) over (column, row), positive for the builder's triangles
+inline long long tin_orient(const Eigen::Vector2i& a, const Eigen::Vector2i& b, const Eigen::Vector2i& c) {
+	return static_cast<long long>(b.y() - c.y()) * (a.x() - c.x()) - static_cast<long long>(b.x() - c.x()) * (a.y() - c.y());
+}
+
+// whether p is inside the circle through a, b, c
+inline bool tin_in_circle(const Eigen::Vector2i& a, const Eigen::Vector2i& b, const Eigen::Vector2i& c, const Eigen::Vector2i& p) {
+	double dx = a.y() - p.y(), dy = a.x() - p.x();
+	double ex = b.y() - p.y(), ey = b.x() - p.x();
+	double fx = c.y() - p.y(), fy = c.x() - p.x();
+	double ap = dx * dx + dy * dy, bp = ex * ex + ey * ey, cp = fx * fx + fy * fy;
+	return dx * (ey * cp - bp * fy) - dy * (ex * cp - bp * fx) + ap * (ex * fy - ey * fx) < 0.0;
+}
+
+void tin_queue_swap(t_tin_builder& builder, int i, int j) {
+	std::swap(builder.queue[i], builder.queue[j]);
+	std::swap(builder.errors[i], builder.errors[j]);
+	builder.queue_indices[builder.queue[i]] = i;
+	builder.queue_indices[builder.queue[j]] = j;
+}
+
+void tin_queue_up(t_tin_builder& builder, int j) {
+	while (j > 0) {
+		int i = (j - 1) / 2;
+		if (builder.errors[j] <= builder.errors[i])
+			break;
+		tin_queue_swap(builder, i, j);
+		j = i;
+	}
+}
+
+// sifts down within the first n entries, returns whether the entry moved
+bool tin_queue_down(t_tin_builder& builder, int i0, int n) {
+	int i = i0;
+	while (2 * i + 1 < n) {
+		int j = 2 * i + 1;
+		if (j + 1 < n && builder.errors[j + 1] > builder.errors[j])
+			j++;
+		if (builder.errors[j] <= builder.errors[i])
+			break;
+		tin_queue_swap(builder, i, j);
+		i = j;
+	}
+	return i > i0;
+}
+
+void tin_queue_pop_back(t_tin_builder& builder) {
+	builder.queue_indices[builder.queue.back()] = -1;
+	builder.queue.pop_back();
+	builder.errors.pop_back();
+}
+
+// takes a triangle that is about to be replaced out of the heap, or out of the pending ones
+void tin_queue_remove(t_tin_builder& builder, int t) {
+	int i = builder.queue_indices[t];
+	if (i < 0) {
+		std::vector<int>::iterator it = std::find(builder.pending.begin(), builder.pending.end(), t);
+		if (it != builder.pending.end()) {
+			*it = builder.pending.back();
+			builder.pending.pop_back();
+		}
+		return;
+	}
+	int n = static_cast<int>(builder.queue.size()) - 1;
+	if (i != n) {
+		tin_queue_swap(builder, i, n);
+		if (!tin_queue_down(builder, i, n))
+			tin_queue_up(builder, i);
+	}
+	tin_queue_pop_back(builder);
+}
+
+// writes triangle (a, b, c) with the given neighbors at halfedge e, appending it when e is past the end.
+// Returns e.
+int tin_add_triangle(t_tin_builder& builder, int a, int b, int c, int ab, int bc, int ca, int e = -1) {
+	if (e < 0) {
+		e = static_cast<int>(builder.triangles.size());
+		builder.triangles.resize(e + 3);
+		builder.halfedges.resize(e + 3);
+		builder.candidates.resize(e / 3 + 1);
+		builder.queue_indices.resize(e / 3 + 1);
+	}
+	int t = e / 3;
+	builder.triangles[e] = a;
+	builder.triangles[e + 1] = b;
+	builder.triangles[e + 2] = c;
+	builder.halfedges[e] = ab;
+	builder.halfedges[e + 1] = bc;
+	builder.halfedges[e + 2] = ca;
+	if (ab >= 0)
+		builder.halfedges[ab] = e;
+	if (bc >= 0)
+		builder.halfedges[bc] = e + 1;
+	if (ca >= 0)
+		builder.halfedges[ca] = e + 2;
+	builder.queue_indices[t] = -1;
+	builder.pending.push_back(t);
+	return e;
+}
+
+// flips the edge at halfedge a while the point across it is inside the circle of a's triangle: the triangles
+// (p0, pr, pl) and (p1, pl, pr), which share the edge from pr to pl, become (p0, p1, pl) and (p1, p0, pr)
+void tin_legalize(t_tin_builder& builder, int a) {
+	int b = builder.halfedges[a];
+	if (b < 0)
+		return;
+	int a0 = a - a % 3, b0 = b - b % 3;
+	int al = a0 + (a + 1) % 3, ar = a0 + (a + 2) % 3;
+	int bl = b0 + (b + 2) % 3, br = b0 + (b + 1) % 3;
+	int p0 = builder.triangles[ar], pr = builder.triangles[a], pl = builder.triangles[al], p1 = builder.triangles[bl];
+	if (!tin_in_circle(builder.points[p0], builder.points[pr], builder.points[pl], builder.points[p1]))
+		return;
+
+	int hal = builder.halfedges[al], har = builder.halfedges[ar], hbl = builder.halfedges[bl], hbr = builder.halfedges[br];
+	tin_queue_remove(builder, a0 / 3);
+	tin_queue_remove(builder, b0 / 3);
+	int t0 = tin_add_triangle(builder, p0, p1, pl, -1, hbl, hal, a0);
+	int t1 = tin_add_triangle(builder, p1, p0, pr, t0, har, hbr, b0);
+	tin_legalize(builder, t0 + 1);
+	tin_legalize(builder, t1 + 2);
+}
+
+// inserts point pn, which lies on the edge at halfedge a, splitting the triangles on both sides of it
+void tin_split_edge(t_tin_builder& builder, int pn, int a) {
+	int a0 = a - a % 3;
+	int al = a0 + (a + 1) % 3, ar = a0 + (a + 2) % 3;
+	int p0 = builder.triangles[ar], pr = builder.triangles[a], pl = builder.triangles[al];
+	int hal = builder.halfedges[al], har = builder.halfedges[ar];
+	int b = builder.halfedges[a];
+	if (b < 0) {
+		// on the border of the map
+		int t0 = tin_add_triangle(builder, pn, p0, pr, -1, har, -1, a0);
+		int t1 = tin_add_triangle(builder, p0, pn, pl, t0, -1, hal);
+		tin_legalize(builder, t0 + 1);
+		tin_legalize(builder, t1 + 2);
+		return;
+	}
+
+	int b0 = b - b % 3;
+	int bl = b0 + (b + 2) % 3, br = b0 + (b + 1) % 3;
+	int p1 = builder.triangles[bl];
+	int hbl = builder.halfedges[bl], hbr = builder.halfedges[br];
+	tin_queue_remove(builder, b0 / 3);
+	int t0 = tin_add_triangle(builder, p0, pr, pn, har, -1, -1, a0);
+	int t1 = tin_add_triangle(builder, pr, p1, pn, hbr, -1, t0 + 1, b0);
+	int t2 = tin_add_triangle(builder, p1, pl, pn, hbl, -1, t1 + 1);
+	int t3 = tin_add_triangle(builder, pl, p0, pn, hal, t0 + 2, t2 + 1);
+	for (int e : { t0, t1, t2, t3 })
+		tin_legalize(builder, e);
+}
+
+// scans the samples inside triangle t with edge functions and queues it with its largest error
+void tin_find_candidate(t_tin_builder& builder, int t) {
+	const Eigen::Vector2i& p0 = builder.points[builder.triangles[3 * t]];
+	const Eigen::Vector2i& p1 = builder.points[builder.triangles[3 * t + 1]];
+	const Eigen::Vector2i& p2 = builder.points[builder.triangles[3 * t + 2]];
+	int min_row = std::min({ p0.x(), p1.x(), p2.x() }), max_row = std::max({ p0.x(), p1.x(), p2.x() });
+	int min_column = std::min({ p0.y(), p1.y(), p2.y() }), max_column = std::max({ p0.y(), p1.y(), p2.y() });
+	Eigen::Vector2i corner(min_row, min_column);
+
+	// the edge functions at the first sample of the bounding box and their steps along a row and a column
+	long long w00 = tin_orient(p1, p2, corner), w01 = tin_orient(p2, p0, corner), w02 = tin_orient(p0, p1, corner);
+	long long a01 = p1.x() - p0.x(), b01 = p0.y() - p1.y();
+	long long a12 = p2.x() - p1.x(), b12 = p1.y() - p2.y();
+	long long a20 = p0.x() - p2.x(), b20 = p2.y() - p0.y();
+
+	// heights premultiplied by the inverse area, so the barycentric weights need no division
+	double area = static_cast<double>(tin_orient(p0, p1, p2));
+	double z0 = builder.heightmap[p0.x()][p0.y()] / area, z1 = builder.heightmap[p1.x()][p1.y()] / area, z2 = builder.heightmap[p2.x()][p2.y()] / area;
+
+	float max_error = 0.0f;
+	Eigen::Vector2i candidate = p0;
+	for (int row = min_row; row <= max_row; row++) {
+		// skip ahead to where the row enters the triangle
+		long long dx = 0;
+		if (w00 < 0 && a12 > 0)
+			dx = std::max(dx, -w00 / a12);
+		if (w01 < 0 && a20 > 0)
+			dx = std::max(dx, -w01 / a20);
+		if (w02 < 0 && a01 > 0)
+			dx = std::max(dx, -w02 / a01);
+		long long w0 = w00 + a12 * dx, w1 = w01 + a20 * dx, w2 = w02 + a01 * dx;
+		bool was_inside = false;
+		for (int column = min_column + static_cast<int>(dx); column <= max_column; column++) {
+			if (w0 >= 0 && w1 >= 0 && w2 >= 0) {
+				was_inside = true;
+				float error = static_cast<float>(abs(z0 * w0 + z1 * w1 + z2 * w2 - builder.heightmap[row][column]));
+				if (error > max_error) {
+					max_error = error;
+					candidate = Eigen::Vector2i(row, column);
+				}
+			} else if (was_inside) {
+				break;
+			}
+			w0 += a12;
+			w1 += a20;
+			w2 += a01;
+		}
+		w00 += b12;
+		w01 += b20;
+		w02 += b01;
+	}
+	if (candidate == p0 || candidate == p1 || candidate == p2)
+		max_error = 0.0f;
+
+	builder.candidates[t] = candidate;
+	int i = static_cast<int>(builder.queue.size());
+	builder.queue_indices[t] = i;
+	builder.queue.push_back(t);
+	builder.errors.push_back(max_error);
+	tin_queue_up(builder, i);
+}
+
+void tin_flush(t_tin_builder& builder) {
+	for (int t : builder.pending)
+		tin_find_candidate(builder, t);
+	builder.pending.clear();
+}
+
+// inserts the sample with the largest error of all
+void tin_refine(t_tin_builder& builder) {
+	int n = static_cast<int>(builder.queue.size()) - 1;
+	int t = builder.queue[0];
+	tin_queue_swap(builder, 0, n);
+	tin_queue_down(builder, 0, n);
+	tin_queue_pop_back(builder);
+
+	int e0 = 3 * t, e1 = 3 * t + 1, e2 = 3 * t + 2;
+	int p0 = builder.triangles[e0], p1 = builder.triangles[e1], p2 = builder.triangles[e2];
+	const Eigen::Vector2i& a = builder.points[p0];
+	const Eigen::Vector2i& b = builder.points[p1];
+	const Eigen::Vector2i& c = builder.points[p2];
+	Eigen::Vector2i p = builder.candidates[t];
+	int pn = static_cast<int>(builder.points.size());
+	bool on_ab = tin_orient(a, b, p) == 0, on_bc = tin_orient(b, c, p) == 0, on_ca = tin_orient(c, a, p) == 0;
+	builder.points.push_back(p);
+
+	if (on_ab) {
+		tin_split_edge(builder, pn, e0);
+	} else if (on_bc) {
+		tin_split_edge(builder, pn, e1);
+	} else if (on_ca) {
+		tin_split_edge(builder, pn, e2);
+	} else {
+		int h0 = builder.halfedges[e0], h1 = builder.halfedges[e1], h2 = builder.halfedges[e2];
+		int t0 = tin_add_triangle(builder, p0, p1, pn, h0, -1, -1, e0);
+		int t1 = tin_add_triangle(builder, p1, p2, pn, h1, -1, t0 + 1);
+		int t2 = tin_add_triangle(builder, p2, p0, pn, h2, t0 + 2, t1 + 1);
+		for (int e : { t0, t1, t2 })
+			tin_legalize(builder, e);
+	}
+	tin_flush(builder);
+}
+
+// Simplifies the heightmap until no sample is more than max_error (heightmap units) off the surface, or until the
+// TIN has max_triangles triangles if that comes first (0 for no limit). Returns the largest error left.
+float build_tin(int** heightmap, int width, int height, float max_error, int max_triangles, t_tin& tin) {
+	t_tin_builder builder;
+	builder.heightmap = heightmap;
+	builder.points = { Eigen::Vector2i(0, 0), Eigen::Vector2i(0, width - 1), Eigen::Vector2i(height - 1, 0), Eigen::Vector2i(height - 1, width - 1) };
+	int t0 = tin_add_triangle(builder, 3, 0, 2, -1, -1, -1);
+	tin_add_triangle(builder, 0, 3, 1, t0, -1, -1);
+	tin_flush(builder);
+
+	while (!builder.queue.empty() && builder.errors[0] > std::max(max_error, 0.0f) && (max_triangles <= 0 || static_cast<int>(builder.triangles.size()) / 3 < max_triangles))
+		tin_refine(builder);
+
+	tin.rows = height;
+	tin.columns = width;
+	tin.points = builder.points;
+	tin.heights.clear();
+	for (const Eigen::Vector2i& point : tin.points)
+		tin.heights.push_back(heightmap[point.x()][point.y()]);
+	tin.triangles = builder.triangles;
+	return builder.queue.empty() ? 0.0f : builder.errors[0];
+}
+
+// The file is little endian: "TIN1", then rows, columns, point count and triangle count as uint32, every point as
+// uint16 row, column and height, every triangle as three uint32 point indices.
+const char TIN_MAGIC[4] = { 'T', 'I', 'N', '1' };
+
+inline void write_uint(FILE* file, uint32_t value, int bytes) {
+	for (int k = 0; k < bytes; k++)
+		fputc((value >> (8 * k)) & 0xFF, file);
+}
+
+inline bool read_uint(FILE* file, uint32_t& value, int bytes) {
+	value = 0;
+	for (int k = 0; k < bytes; k++) {
+		int byte = fgetc(file);
+		if (byte == EOF)
+			return false;
+		value |= static_cast<uint32_t>(byte) << (8 * k);
+	}
+	return true;
+}
+
+bool save_tin(const char* path, const t_tin& tin) {
+	FILE* file = fopen(path, "wb");
+	if (file == NULL)
+		return false;
+	fwrite(TIN_MAGIC, 1, sizeof(TIN_MAGIC), file);
+	write_uint(file, tin.rows, 4);
+	write_uint(file, tin.columns, 4);
+	write_uint(file, static_cast<uint32_t>(tin.points.size()), 4);
+	write_uint(file, static_cast<uint32_t>(tin.triangles.size() / 3), 4);
+	for (size_t k = 0; k < tin.points.size(); k++) {
+		write_uint(file, tin.points[k].x(), 2);
+		write_uint(file, tin.points[k].y(), 2);
+		write_uint(file, tin.heights[k], 2);
+	}
+	for (int point : tin.triangles)
+		write_uint(file, point, 4);
+	return fclose(file) == 0;
+}
+
+bool load_tin(const char* path, t_tin& tin) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL)
+		return false;
+	char magic[4];
+	uint32_t rows, columns, point_count, triangle_count;
+	bool ok = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, TIN_MAGIC, sizeof(magic)) == 0
+		&& read_uint(file, rows, 4) && read_uint(file, columns, 4) && read_uint(file, point_count, 4) && read_uint(file, triangle_count, 4)
+		&& rows >= 2 && columns >= 2 && rows <= 65536 && columns <= 65536 && triangle_count <= UINT32_MAX / 3;
+	if (!ok) {
+		fclose(file);
+		return false;
+	}
+	tin.rows = rows;
+	tin.columns = columns;
+	tin.points.clear();
+	tin.heights.clear();
+	tin.triangles.clear();
+	for (uint32_t k = 0; ok && k < point_count; k++) {
+		uint32_t row, column, height;
+		ok = read_uint(file, row, 2) && read_uint(file, column, 2) && read_uint(file, height, 2) && row < rows && column < columns;
+		if (!ok)
+			break;
+		tin.points.push_back(Eigen::Vector2i(row, column));
+		tin.heights.push_back(height);
+	}
+	for (uint32_t k = 0; ok && k < 3 * triangle_count; k++) {
+		uint32_t point;
+		ok = read_uint(file, point, 4) && point < point_count;
+		if (ok)
+			tin.triangles.push_back(point);
+	}
+	fclose(file);
+	return ok;
+}
+
+// loads the TIN drawn in place of the grid, which has to be built from the heightmap the other backends draw
+bool load_terrain_tin(const char* path, int width, int height, t_tin& tin) {
+	if (!load_tin(path, tin)) {
+		printf("Could not read the TIN %s\n", path);
+		return false;
+	}
+	if (tin.rows != height || tin.columns != width) {
+		printf("The TIN %s was built from a %dx%d heightmap, not this %dx%d one\n", path, tin.columns, tin.rows, width, height);
+		return false;
+	}
+	return true;
+}
+
+// Turns the TIN into a mesh in place of the grid. Vertex normals average the normals of the triangles around them,
+// weighted by area, with unscaled heights as in set_heightmap_normal. Triangles are chunked by the CHUNK_SIZE cell
+// their centroid falls in, for frustum culling.
+void tin_mesh(const t_tin& tin, t_mesh& mesh) {
+	reset_mesh(mesh, tin.rows, tin.columns);
+
+	std::vector<Eigen::Vector3f> normals(tin.points.size(), Eigen::Vector3f::Zero());
+	for (size_t t = 0; t < tin.triangles.size(); t += 3) {
+		Eigen::Vector3f corners[3];
+		for (int v = 0; v < 3; v++) {
+			int point = tin.triangles[t + v];
+			corners[v] = Eigen::Vector3f(mesh.grid_origin.x() + tin.points[point].x() * mesh.cell_size.x(), mesh.grid_origin.y() + tin.points[point].y() * mesh.cell_size.y(), tin.heights[point] / 255.0f);
+		}
+		Eigen::Vector3f normal = (corners[1] - corners[0]).cross(corners[2] - corners[0]);
+		if (normal.z() < 0.0f)
+			normal = -normal;
+		for (int v = 0; v < 3; v++)
+			normals[tin.triangles[t + v]] += normal;
+	}
+	std::vector<t_packed_vertex> points(tin.points.size());
+	for (size_t k = 0; k < tin.points.size(); k++)
+		points[k] = pack_vertex(tin.points[k].x(), tin.points[k].y(), tin.heights[k], normals[k].normalized());
+
+	int chunk_rows = (mesh.rows + CHUNK_SIZE - 1) / CHUNK_SIZE, chunk_columns = (mesh.columns + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	std::vector<std::vector<int>> buckets(static_cast<size_t>(chunk_rows) * chunk_columns);
+	for (size_t t = 0; t < tin.triangles.size(); t += 3) {
+		const Eigen::Vector2i& a = tin.points[tin.triangles[t]];
+		const Eigen::Vector2i& b = tin.points[tin.triangles[t + 1]];
+		const Eigen::Vector2i& c = tin.points[tin.triangles[t + 2]];
+		int row = std::min((a.x() + b.x() + c.x()) / 3 / CHUNK_SIZE, chunk_rows - 1);
+		int column = std::min((a.y() + b.y() + c.y()) / 3 / CHUNK_SIZE, chunk_columns - 1);
+		buckets[static_cast<size_t>(row) * chunk_columns + column].push_back(static_cast<int>(t));
+	}
+	for (const std::vector<int>& bucket : buckets) {
+		if (bucket.empty())
+			continue;
+		open_chunk(mesh);
+		for (int t : bucket) {
+			int corners[3] = { tin.triangles[t], tin.triangles[t + 1], tin.triangles[t + 2] };
+			if (sample_area(tin.points[corners[0]], tin.points[corners[1]], tin.points[corners[2]]) > 0)
+				std::swap(corners[1], corners[2]);
+			for (int corner : corners)
+				mesh.verticies.push_back(points[corner]);
+		}
+		close_chunk(mesh);
+	}
+}
+
+// view space distances in front of the camera that geometry is clipped to
+const float NEAR_PLANE = 0.01f;
+const float FAR_PLANE = 100.0f;
+
+// a world space plane, point p is on the inside when normal.dot(p) + offset <= 0
+typedef struct s_plane {
+	Eigen::Vector3f normal;
+	float offset;
+} t_plane;
+
+// everything needed to take a world space point to pixel coordinates, built once per frame
+typedef struct s_view {
+	Eigen::Matrix3f view_matrix; // world to view rotation
+	Eigen::Vector3f camera_position;
+	float perspective_factor;
+	float zoom_factor;
+	t_plane frustum[6]; // left, right, bottom, top, near, far
+	float exaggeration; // heights are stretched by this on their way to view space, see terrain_to_view_space
+	bool cull_backfaces;
+	int viewport_width, viewport_height; // in pixels
+} t_view;
+
+// the four side planes go through the camera and the window borders, derived from the projection in to_pixel_coordinates
+void build_frustum(t_view& view) {
+	float slope_x = (view.viewport_width / 2.0f) / (view.zoom_factor * view.perspective_factor);
+	float slope_y = (view.viewport_height / 2.0f) / (view.zoom_factor * view.perspective_factor);
+
+	// view space normals, the camera looks down the negative z-axis
+	Eigen::Vector3f normals[6] = {
+		Eigen::Vector3f(-1.0f, 0.0f, slope_x),
+		Eigen::Vector3f(1.0f, 0.0f, slope_x),
+		Eigen::Vector3f(0.0f, -1.0f, slope_y),
+		Eigen::Vector3f(0.0f, 1.0f, slope_y),
+		Eigen::Vector3f(0.0f, 0.0f, 1.0f),
+		Eigen::Vector3f(0.0f, 0.0f, -1.0f)
+	};
+
+	for (int k = 0; k < 6; k++) {
+		// the view matrix is a rotation, so its transpose takes the normals back to world space
+		view.frustum[k].normal = view.view_matrix.transpose() * normals[k];
+		view.frustum[k].offset = -view.frustum[k].normal.dot(view.camera_position);
+	}
+	view.frustum[4].offset += NEAR_PLANE;
+	view.frustum[5].offset -= FAR_PLANE;
+}
+
+// conservative: true only if the whole box is on the outside of one of the planes
+bool box_outside_frustum(const Eigen::AlignedBox3f& box, const t_plane frustum[6]) {
+	for (int k = 0; k < 6; k++) {
+		const Eigen::Vector3f& n = frustum[k].normal;
+		// the corner of the box that is furthest on the inside of this plane
+		Eigen::Vector3f corner(n.x() > 0.0f ? box.min().x() : box.max().x(),
+			n.y() > 0.0f ? box.min().y() : box.max().y(),
+			n.z() > 0.0f ? box.min().z() : box.max().z());
+		if (n.dot(corner) + frustum[k].offset > 0.0f)
+			return true;
+	}
+	return false;
+}
+
+// the viewport defaults to the window, offscreen targets of other sizes show the same framing scaled to their height
+void build_view(t_view& view, int viewport_width = SCREEN_WIDTH, int viewport_height = SCREEN_HEIGHT) {
+	Eigen::Vector3f focus_point(0.0f, 0.0f, 0.0f);
+	Eigen::Vector3f camera_look_at = camera_position - focus_point;
+	camera_look_at.normalize();
+
+	Eigen::Vector3f camera_up(0.0f, 0.0f, 1.0f);
+
+	Eigen::Vector3f camera_right = camera_up.cross(camera_look_at);
+	camera_right.normalize();
+
+	camera_up = camera_look_at.cross(camera_right);
+	camera_up.normalize();
+
+	// these lines build the matrix that transforms from view coords to world coords
+	view.view_matrix.col(0) << camera_right;
+	view.view_matrix.col(1) << camera_up;
+	view.view_matrix.col(2) << camera_look_at;
+
+	// we take the transpose of it to take its inverse
+	view.view_matrix.transposeInPlace();
+
+	view.camera_position = camera_position;
+	view.perspective_factor = perspective_factor;
+	view.zoom_factor = 500.0f * viewport_height / SCREEN_HEIGHT;
+	view.exaggeration = vertical_exaggeration;
+	view.cull_backfaces = backface_culling;
+	view.viewport_width = viewport_width;
+	view.viewport_height = viewport_height;
+	build_frustum(view);
+}
+
+inline Eigen::Vector3f to_view_space(const t_view& view, const Eigen::Vector3f& position) {
+	return view.view_matrix * (position - view.camera_position);
+}
+
+// for points of the terrain, which are kept before the exaggeration
+inline Eigen::Vector3f terrain_to_view_space(const t_view& view, const Eigen::Vector3f& position) {
+	return to_view_space(view, Eigen::Vector3f(position.x(), position.y(), position.z() * view.exaggeration));
+}
+
+// the world space bounds of terrain kept before the exaggeration, which only ever has heights >= 0
+inline Eigen::AlignedBox3f exaggerate_box(const Eigen::AlignedBox3f& box, float exaggeration) {
+	Eigen::AlignedBox3f exaggerated = box;
+	exaggerated.min().z() *= exaggeration;
+	exaggerated.max().z() *= exaggeration;
+	return exaggerated;
+}
+
+// The homogeneous w of a view space point is -z, so the point has to be clipped to z <= -NEAR_PLANE before this
+// is called. The z-coordinate of the result is the (zoomed) view space depth, it is negative in front of the camera.
+inline Eigen::Vector3f view_to_pixel_coordinates(const t_view& view, Eigen::Vector3f p) {
+	// perspective division
+	p.x() *= view.perspective_factor / -p.z();
+	p.y() *= view.perspective_factor / -p.z();
+	// !!! NOTE that we do not divide the z-coordinate since we need to perserve it for visible surface detection
+
+	p *= view.zoom_factor;
+
+	// transform to pixel coordinates
+	p.x() += view.viewport_width / 2.0f;
+	p.y() += view.viewport_height / 2.0f;
+	return p;
+}
+
+inline Eigen::Vector3f to_pixel_coordinates(const t_view& view, const Eigen::Vector3f& position) {
+	return view_to_pixel_coordinates(view, to_view_space(view, position));
+}
+
+// a polygon corner during clipping, in view space
+typedef struct s_clip_vertex {
+	Eigen::Vector3f position;
+	Eigen::Vector3f color; // kept as floats so it can be interpolated along clipped edges
+} t_clip_vertex;
+
+// the signed distance of a view space point to the near (> 0 is in front of it) or far plane (> 0 is before it)
+inline float near_distance(const Eigen::Vector3f& p) { return -p.z() - NEAR_PLANE; }
+inline float far_distance(const Eigen::Vector3f& p) { return FAR_PLANE + p.z(); }
+
+// Sutherland-Hodgman step: keeps the part of the convex polygon where distance() >= 0.
+// out needs room for count + 1 verticies, returns the new vertex count.
+int clip_polygon(const t_clip_vertex* in, int count, float (*distance)(const Eigen::Vector3f&), t_clip_vertex* out) {
+	int out_count = 0;
+	for (int k = 0; k < count; k++) {
+		const t_clip_vertex& a = in[k];
+		const t_clip_vertex& b = in[(k + 1) % count];
+		float da = distance(a.position);
+		float db = distance(b.position);
+
+		if (da >= 0.0f)
+			out[out_count++] = a;
+		if ((da >= 0.0f) != (db >= 0.0f)) {
+			float f = da / (da - db);
+			out[out_count].position = a.position + f * (b.position - a.position);
+			out[out_count].color = a.color + f * (b.color - a.color);
+			out_count++;
+		}
+	}
+	return out_count;
+}
+
+// A CPU render target. Pixels are stored row by row as bytes R, G, B, A, which is both SDL_PIXELFORMAT_RGBA32 and what
+// lodepng expects. The depth buffer holds 1 / w, so larger is closer and 0 means nothing was drawn.
+typedef struct s_framebuffer {
+	int width = 0, height = 0;
+	std::vector<uint32_t> color;
+	std::vector<float> depth;
+} t_framebuffer;
+
+// triangles with less than this (doubled) screen area in pixels are considered degenerate
+const float DEGENERATE_AREA = 1e-3f;
+
+// bits of t_frame::triangle_flags
+const unsigned char TRIANGLE_VISIBLE = 1;
+const unsigned char TRIANGLE_HAS_PIECES = 2; // clipping left extra pieces of this triangle at the end of the frame
+
+// what one chunk produced during projection, gathered in chunk order after the parallel pass
+typedef struct s_chunk_output {
+	std::vector<int> visible_triangles;
+	std::vector<SDL_Vertex> clipped_verticies; // extra pieces of triangles cut by the near/far plane
+	std::vector<float> clipped_inverse_depths;
+	std::vector<float> clipped_depth_keys;
+	std::vector<int> clipped_parents; // the mesh triangle each piece came from
+} t_chunk_output;
+
+// per-frame output of project_triangles, kept alive between frames so the buffers are only allocated once
+typedef struct s_frame {
+	std::vector<SDL_Vertex> sdl_verticies; // same layout as the mesh: three per triangle, clipped pieces at the end
+	std::vector<float> inverse_depths; // 1 / w of every SDL vertex, for the software rasterizer's depth buffer
+	std::vector<float> depth_keys; // one per triangle, larger is further away
+	std::vector<int> visible_triangles; // compacted list of the triangles that survived all culling, in chunk order
+	std::vector<unsigned char> triangle_flags; // one per mesh triangle, only valid in visible chunks
+	int first_clipped_triangle;
+	std::vector<int> clipped_parents; // for every triangle from first_clipped_triangle on, ascending
+	std::vector<int> index_list; // draw order handed to SDL_RenderGeometry
+	std::vector<int> visible_chunks; // chunks that passed the frustum test, only their entries above are valid
+	std::vector<unsigned char> chunk_visible; // one per chunk
+	std::vector<int> chunk_levels; // one per chunk, only valid while the levels of detail are drawn
+	std::vector<t_chunk_output> chunk_outputs; // one per visible chunk
+	std::vector<uint8_t> normal_shades; // per octahedral normal code, see build_normal_shades
+	Eigen::Vector3f shaded_light; // the light direction and exaggeration normal_shades was built for
+	float shaded_exaggeration = 0.0f;
+	std::vector<uint32_t> sort_keys, sort_key_buffer; // ping-pong buffers of depth_order
+	std::vector<int> sort_triangles, sort_triangle_buffer;
+	std::vector<int> horizon_top, horizon_bottom; // one per screen column, see horizon_cull
+
+	// state carried between frames by incremental_depth_order
+	bool previous_order_valid = false;
+	Eigen::Vector3f previous_camera_position;
+	std::vector<int> previous_order; // last frame's sorted mesh triangles
+	std::vector<uint32_t> fresh_keys; // triangles that were not visible last frame
+	std::vector<int> fresh_triangles;
+	std::vector<uint32_t> sort_stamps; // one per mesh triangle, see incremental_depth_order
+	uint32_t sort_stamp = 0;
+
+	// target of the software backend
+	std::vector<std::vector<int>> tile_bins; // triangles per tile, see rasterize_frame
+	t_framebuffer framebuffer;
+	SDL_Texture* framebuffer_texture = NULL;
+} t_frame;
+
+// writes one projected triangle and its depth key, returns false if it is off screen, degenerate or (optionally) a backface
+inline bool emit_triangle(const t_view& view, const t_clip_vertex& a, const t_clip_vertex& b, const t_clip_vertex& c, SDL_Vertex* out, float* inverse_depth, float& depth) {
+	const t_clip_vertex* corners[3] = { &a, &b, &c };
+	float min_x = INFINITY, max_x = -INFINITY, min_y = INFINITY, max_y = -INFINITY;
+	depth = 0.0f;
+
+	for (int k = 0; k < 3; k++) {
+		Eigen::Vector3f p = view_to_pixel_coordinates(view, corners[k]->position);
+
+		// SDL vertices are 2D, so that is why I created my own data struct
+		out[k].position.x = p.x();
+		out[k].position.y = view.viewport_height - p.y();
+		out[k].color = SDL_Color{ static_cast<Uint8>(corners[k]->color.x()), static_cast<Uint8>(corners[k]->color.y()), static_cast<Uint8>(corners[k]->color.z()), 0xFF };
+		out[k].tex_coord = SDL_FPoint{ 0.0f, 0.0f };
+		inverse_depth[k] = 1.0f / -corners[k]->position.z(); // clipping guarantees this is positive
+
+		depth += p.z();
+		min_x = std::min(min_x, out[k].position.x);
+		max_x = std::max(max_x, out[k].position.x);
+		min_y = std::min(min_y, out[k].position.y);
+		max_y = std::max(max_y, out[k].position.y);
+	}
+
+	depth = abs(depth);
+
+	// twice the signed screen area, the top of the terrain winds clockwise on screen, which is positive since SDL's y points down
+	float area = (out[1].position.x - out[0].position.x) * (out[2].position.y - out[0].position.y)
+		- (out[1].position.y - out[0].position.y) * (out[2].position.x - out[0].position.x);
+	if (view.cull_backfaces ? area <= DEGENERATE_AREA : abs(area) <= DEGENERATE_AREA)
+		return false;
+
+	// triangles whose screen bounding box misses the window are neither sorted nor submitted
+	return max_x >= 0.0f && min_x < view.viewport_width && max_y >= 0.0f && min_y < view.viewport_height;
+}
+
+// what project_triangle needs to take a mesh's packed verticies to view space, built once per frame
+typedef struct s_vertex_decoder {
+	Eigen::Matrix3f to_view; // (row, column, height) to view space: the view rotation with the mesh's scales and the exaggeration folded in
+	Eigen::Vector3f offset; // view space position of sample (0, 0) at height 0
+	const uint8_t* shades; // per normal code
+} t_vertex_decoder;
+
+// There are only 2^16 normal codes, so every one of them is exaggerated and shaded once per light direction and
+// exaggeration and the verticies just look theirs up; the cost does not depend on the size of the mesh.
+void build_normal_shades(const t_view& view, t_frame& frame) {
+	if (frame.normal_shades.size() == 1 << 16 && frame.shaded_light == light_direction && frame.shaded_exaggeration == view.exaggeration)
+		return;
+	frame.normal_shades.resize(1 << 16);
+	frame.shaded_light = light_direction;
+	frame.shaded_exaggeration = view.exaggeration;
+	parallel_for(thread_pool, 1 << 16, [&](int begin, int end) {
+		for (int code = begin; code < end; code++)
+			frame.normal_shades[code] = shade(exaggerate_normal(decode_normal(code & 0xFF, code >> 8), view.exaggeration)).r;
+	});
+}
+
+t_vertex_decoder vertex_decoder(const t_mesh& mesh, const t_view& view, const t_frame& frame) {
+	t_vertex_decoder decoder;
+	decoder.to_view = view.view_matrix * Eigen::Vector3f(mesh.cell_size.x(), mesh.cell_size.y(), mesh.height_scale * view.exaggeration).asDiagonal();
+	decoder.offset = to_view_space(view, Eigen::Vector3f(mesh.grid_origin.x(), mesh.grid_origin.y(), 0.0f));
+	decoder.shades = frame.normal_shades.data();
+	return decoder;
+}
+
+// Projects, shades and emits triangle t, and computes its depth key and culls it while the positions are at hand;
+// if it survives, it is added to the visible triangles of its chunk.
+// A triangle cut by the near or far plane is clipped before the perspective divide; the first piece takes its slot and
+// any further pieces go to the clipped list of its chunk.
+inline void project_triangle(const std::vector<t_packed_vertex>& verticies, const t_vertex_decoder& decoder, const t_view& view, int t, t_frame& frame, t_chunk_output& output) {
+	// a triangle clipped by two planes has at most five corners
+	t_clip_vertex polygon[5];
+	t_clip_vertex clipped[5];
+	bool needs_clipping = false;
+
+	for (int k = 0; k < 3; k++) {
+		const t_packed_vertex& v = verticies[3 * t + k];
+		float brightness = decoder.shades[v.normal[0] | v.normal[1] << 8]; // looked up every frame, the light may have moved
+		polygon[k].position = decoder.to_view * Eigen::Vector3f(v.row, v.column, v.height) + decoder.offset;
+		polygon[k].color = Eigen::Vector3f(brightness, brightness, brightness);
+		needs_clipping |= near_distance(polygon[k].position) < 0.0f || far_distance(polygon[k].position) < 0.0f;
+	}
+
+	frame.triangle_flags[t] = 0;
+	if (!needs_clipping) {
+		if (emit_triangle(view, polygon[0], polygon[1], polygon[2], &frame.sdl_verticies[3 * t], &frame.inverse_depths[3 * t], frame.depth_keys[t])) {
+			output.visible_triangles.push_back(t);
+			frame.triangle_flags[t] = TRIANGLE_VISIBLE;
+		}
+		return;
+	}
+
+	int count = clip_polygon(polygon, 3, near_distance, clipped);
+	count = clip_polygon(clipped, count, far_distance, polygon);
+	if (count < 3)
+		return; // entirely behind the camera or beyond the far plane
+
+	// the clipped polygon is convex, so it is split into a fan around its first corner
+	if (emit_triangle(view, polygon[0], polygon[1], polygon[2], &frame.sdl_verticies[3 * t], &frame.inverse_depths[3 * t], frame.depth_keys[t])) {
+		output.visible_triangles.push_back(t);
+		frame.triangle_flags[t] = TRIANGLE_VISIBLE;
+	}
+	for (int k = 2; k + 1 < count; k++) {
+		SDL_Vertex out[3];
+		float inverse_depth[3];
+		float depth;
+		if (emit_triangle(view, polygon[0], polygon[k], polygon[k + 1], out, inverse_depth, depth)) {
+			output.clipped_verticies.insert(output.clipped_verticies.end(), out, out + 3);
+			output.clipped_inverse_depths.insert(output.clipped_inverse_depths.end(), inverse_depth, inverse_depth + 3);
+			output.clipped_depth_keys.push_back(depth);
+			output.clipped_parents.push_back(t);
+			frame.triangle_flags[t] |= TRIANGLE_HAS_PIECES;
+		}
+	}
+}
+
+// a level's height error is allowed to move it by this many pixels on screen
+const float LOD_PIXEL_ERROR = 1.0f;
+
+inline bool drawing_levels(const t_mesh& mesh) {
+	return level_of_detail && mesh.has_levels;
+}
+
+// Picks every chunk's level of detail: the coarsest one whose height error, seen from the camera at the chunk's
+// nearest point, stays within LOD_PIXEL_ERROR pixels. Distant chunks go coarse, so the number of triangles drawn
+// depends on the screen more than on the size of the map.
+void select_chunk_levels(const t_mesh& mesh, const t_view& view, t_frame& frame) {
+	float focal_length = view.perspective_factor * view.zoom_factor; // pixels per world unit at distance 1
+	frame.chunk_levels.resize(mesh.chunks.size());
+	for (size_t c = 0; c < mesh.chunks.size(); c++) {
+		const t_chunk& chunk = mesh.chunks[c];
+		float distance = exaggerate_box(chunk.bounds, view.exaggeration).exteriorDistance(view.camera_position);
+		int level = 0;
+		while (level < chunk.lod_max_level && chunk.lod_error[level + 1] * view.exaggeration * focal_length <= LOD_PIXEL_ERROR * distance)
+			level++;
+		frame.chunk_levels[c] = level;
+	}
+}
+
+// The triangle runs chunk c is drawn with this frame, returns how many. With the levels of detail, both chunks along
+// a shared edge use the coarser of their levels on it, or the full grid's samples if either has no levels.
+int chunk_triangle_ranges(const t_mesh& mesh, const t_frame& frame, int c, t_triangle_range* ranges) {
+	const t_chunk& chunk = mesh.chunks[c];
+	if (!drawing_levels(mesh) || chunk.lod_max_level < 0) {
+		ranges[0] = t_triangle_range{ chunk.first_triangle, chunk.triangle_count };
+		return 1;
+	}
+
+	int level = frame.chunk_levels[c];
+	int chunk_row = c / mesh.chunk_columns, chunk_column = c % mesh.chunk_columns;
+	int chunk_rows = static_cast<int>(mesh.chunks.size()) / mesh.chunk_columns;
+	int neighbors[SIDE_COUNT] = {
+		chunk_row > 0 ? c - mesh.chunk_columns : -1,
+		chunk_row + 1 < chunk_rows ? c + mesh.chunk_columns : -1,
+		chunk_column > 0 ? c - 1 : -1,
+		chunk_column + 1 < mesh.chunk_columns ? c + 1 : -1
+	};
+
+	ranges[0] = chunk.lod_inside[level];
+	for (int side = 0; side < SIDE_COUNT; side++) {
+		int edge_level = level;
+		if (neighbors[side] >= 0)
+			edge_level = mesh.chunks[neighbors[side]].lod_max_level < 0 ? 0 : std::max(level, frame.chunk_levels[neighbors[side]]);
+		ranges[1 + side] = chunk.lod_strips[level][side][edge_level];
+	}
+	return 1 + SIDE_COUNT;
+}
+
+// Single pass over the mesh: every source vertex is read once, and the SDL_Vertex, depth key and visibility flag
+// all come out of it together. Chunks outside the view frustum are skipped entirely.
+void project_triangles(const t_mesh& mesh, const t_view& view, t_frame& frame) {
+	int triangle_count = static_cast<int>(mesh.verticies.size() / 3);
+	frame.sdl_verticies.resize(mesh.verticies.size());
+	frame.inverse_depths.resize(mesh.verticies.size());
+	frame.depth_keys.resize(triangle_count);
+	frame.triangle_flags.resize(triangle_count);
+
+	frame.visible_chunks.clear();
+	frame.chunk_visible.assign(mesh.chunks.size(), false);
+	for (int c = 0; c < static_cast<int>(mesh.chunks.size()); c++) {
+		if (!box_outside_frustum(exaggerate_box(mesh.chunks[c].bounds, view.exaggeration), view.frustum)) {
+			frame.visible_chunks.push_back(c);
+			frame.chunk_visible[c] = true;
+		}
+	}
+
+	if (drawing_levels(mesh))
+		select_chunk_levels(mesh, view, frame);
+
+	build_normal_shades(view, frame);
+	t_vertex_decoder decoder = vertex_decoder(mesh, view, frame);
+
+	int visible_chunk_count = static_cast<int>(frame.visible_chunks.size());
+	if (static_cast<int>(frame.chunk_outputs.size()) < visible_chunk_count)
+		frame.chunk_outputs.resize(visible_chunk_count);
+
+	// a chunk is a few thousand triangles, enough work to hand out one at a time
+	parallel_for(thread_pool, visible_chunk_count, [&](int begin, int end) {
+		for (int c = begin; c < end; c++) {
+			t_chunk_output& output = frame.chunk_outputs[c];
+			output.visible_triangles.clear();
+			output.clipped_verticies.clear();
+			output.clipped_inverse_depths.clear();
+			output.clipped_depth_keys.clear();
+			output.clipped_parents.clear();
+			t_triangle_range ranges[1 + SIDE_COUNT];
+			int range_count = chunk_triangle_ranges(mesh, frame, frame.visible_chunks[c], ranges);
+			for (int r = 0; r < range_count; r++) {
+				for (int t = ranges[r].first; t < ranges[r].first + ranges[r].count; t++)
+					project_triangle(mesh.verticies, decoder, view, t, frame, output);
+			}
+		}
+	}, 1);
+
+	// the per-chunk lists are joined in chunk order, which keeps the output independent of the thread count
+	frame.visible_triangles.clear();
+	for (int c = 0; c < visible_chunk_count; c++) {
+		const t_chunk_output& output = frame.chunk_outputs[c];
+		frame.visible_triangles.insert(frame.visible_triangles.end(), output.visible_triangles.begin(), output.visible_triangles.end());
+	}
+	// chunks are in mesh order, so the parents of the clipped pieces come out ascending
+	frame.first_clipped_triangle = triangle_count;
+	frame.clipped_parents.clear();
+	for (int c = 0; c < visible_chunk_count; c++) {
+		const t_chunk_output& output = frame.chunk_outputs[c];
+		for (int k = 0; k < static_cast<int>(output.clipped_depth_keys.size()); k++)
+			frame.visible_triangles.push_back(static_cast<int>(frame.depth_keys.size()) + k);
+		frame.clipped_parents.insert(frame.clipped_parents.end(), output.clipped_parents.begin(), output.clipped_parents.end());
+		frame.sdl_verticies.insert(frame.sdl_verticies.end(), output.clipped_verticies.begin(), output.clipped_verticies.end());
+		frame.inverse_depths.insert(frame.inverse_depths.end(), output.clipped_inverse_depths.begin(), output.clipped_inverse_depths.end());
+		frame.depth_keys.insert(frame.depth_keys.end(), output.clipped_depth_keys.begin(), output.clipped_depth_keys.end());
+	}
+}
+
+// a wireframe edge clipped and projected to pixel coordinates, with 1 / w at both ends; w0 is 0 if nothing is left
+typedef struct s_line_segment {
+	float x0, y0, w0, x1, y1, w1;
+} t_line_segment;
+
+// The wireframe is the heightmap grid itself: every row and every column of samples is one polyline, so a frame
+// takes one draw call per polyline instead of one per edge.
+typedef struct s_wireframe {
+	int rows, columns; // samples
+	Eigen::Vector2f grid_origin; // world x/y of sample (0, 0), same as the mesh
+	Eigen::Vector2f cell_size; // world x/y distance between samples, same as the mesh
+	std::vector<Eigen::Vector3f> points; // world positions before the exaggeration, row major
+	std::vector<Eigen::Vector3f> view_points; // the points in view space, per frame
+	std::vector<SDL_FPoint> strip; // the part of a polyline being gathered for SDL_RenderDrawLinesF
+	std::vector<t_line_segment> segments; // every grid edge once projected, for rasterize_wireframe
+} t_wireframe;
+
+void wireframe_from_heightmap(int** heightmap, int width, int height, t_wireframe& wireframe) {
+	// heightmap will displace a unit rectangle with corners at (-0.5,-0.5,0) and (0.5, 0.5, 0), the lines lie on the
+	// mesh surface, which the software backend tests them against
+	wireframe.rows = height;
+	wireframe.columns = width;
+	wireframe.grid_origin = Eigen::Vector2f(-0.5f, -0.5f); // matches tris_from_heightmap
+	wireframe.cell_size = Eigen::Vector2f(1.0f / height, 1.0f / width);
+	wireframe.points.resize(static_cast<size_t>(width) * height);
+	for (int i = 0; i < height; i++) {
+		for (int j = 0; j < width; j++) {
+			wireframe.points[static_cast<size_t>(i) * width + j] = Eigen::Vector3f(wireframe.grid_origin.x() + i * wireframe.cell_size.x(),
+				wireframe.grid_origin.y() + j * wireframe.cell_size.y(), HEIGHT_SCALE * heightmap[i][j]);
+		}
+	}
+}
+
+// hands the gathered strip to SDL and starts a new one
+inline void flush_strip(SDL_Renderer* renderer, std::vector<SDL_FPoint>& strip) {
+	if (strip.size() >= 2)
+		SDL_RenderDrawLinesF(renderer, strip.data(), static_cast<int>(strip.size()));
+	strip.clear();
+}
+
+inline SDL_FPoint to_strip_point(const t_view& view, const Eigen::Vector3f& view_point) {
+	Eigen::Vector3f p = view_to_pixel_coordinates(view, view_point);
+	return SDL_FPoint{ p.x(), view.viewport_height - p.y() };
+}
+
+// clips the view space segment a b against the near and far planes, returns false if nothing is left
+inline bool clip_segment(Eigen::Vector3f& a, Eigen::Vector3f& b, bool& a_clipped, bool& b_clipped) {
+	a_clipped = b_clipped = false;
+	for (float (*distance)(const Eigen::Vector3f&) : { near_distance, far_distance }) {
+		float d0 = distance(a);
+		float d1 = distance(b);
+		if (d0 < 0.0f && d1 < 0.0f)
+			return false;
+		if (d0 < 0.0f) {
+			a += d0 / (d0 - d1) * (b - a);
+			a_clipped = true;
+		} else if (d1 < 0.0f) {
+			b += d1 / (d1 - d0) * (a - b);
+			b_clipped = true;
+		}
+	}
+	return true;
+}
+
+// Draws one polyline of count points, first and then every stride-th. Every segment is clipped against the near and
+// far planes, a clipped end breaks the polyline into separate strips.
+void draw_polyline(SDL_Renderer* renderer, const t_view& view, t_wireframe& wireframe, size_t first, size_t stride, int count) {
+	std::vector<SDL_FPoint>& strip = wireframe.strip;
+	for (int k = 0; k + 1 < count; k++) {
+		Eigen::Vector3f a = wireframe.view_points[first + k * stride];
+		Eigen::Vector3f b = wireframe.view_points[first + (k + 1) * stride];
+		bool a_clipped, b_clipped;
+		if (!clip_segment(a, b, a_clipped, b_clipped)) {
+			flush_strip(renderer, strip);
+			continue;
+		}
+		if (a_clipped)
+			flush_strip(renderer, strip);
+		if (strip.empty())
+			strip.push_back(to_strip_point(view, a));
+		strip.push_back(to_strip_point(view, b));
+		if (b_clipped)
+			flush_strip(renderer, strip);
+	}
+	flush_strip(renderer, strip);
+}
+
+// Maps a depth key to a 32 bit sort key. Depth keys are never negative, and the bit pattern of a non-negative float
+// orders the same way as its value, so inverting it gives an ascending key for a back to front (descending) order.
+inline uint32_t depth_sort_key(float depth) {
+	uint32_t bits;
+	memcpy(&bits, &depth, sizeof(bits));
+	return ~bits;
+}
+
+// Stable LSD radix sort of (key, value) pairs on 8 bit digits, keys and values are sorted in place.
+// The buffers are scratch space that is swapped with the inputs after every pass, so their memory is reused between calls.
+// Passes where all keys share the same digit are skipped.
+void radix_sort(std::vector<uint32_t>& keys, std::vector<int>& values, std::vector<uint32_t>& key_buffer, std::vector<int>& value_buffer) {
+	int count = static_cast<int>(keys.size());
+	if (count == 0)
+		return;
+	key_buffer.resize(count);
+	value_buffer.resize(count);
+
+	// one pass over the keys fills the histograms of all four digits
+	int histograms[4][256] = {};
+	for (uint32_t key : keys) {
+		for (int digit = 0; digit < 4; digit++)
+			histograms[digit][(key >> (8 * digit)) & 0xFF]++;
+	}
+
+	for (int digit = 0; digit < 4; digit++) {
+		int* histogram = histograms[digit];
+		if (histogram[(keys[0] >> (8 * digit)) & 0xFF] == count)
+			continue;
+
+		// exclusive prefix sum turns the counts into output offsets
+		int offset = 0;
+		for (int bucket = 0; bucket < 256; bucket++) {
+			int bucket_count = histogram[bucket];
+			histogram[bucket] = offset;
+			offset += bucket_count;
+		}
+
+		for (int k = 0; k < count; k++) {
+			int destination = histogram[(keys[k] >> (8 * digit)) & 0xFF]++;
+			key_buffer[destination] = keys[k];
+			value_buffer[destination] = values[k];
+		}
+		keys.swap(key_buffer);
+		values.swap(value_buffer);
+	}
+}
+
+// Multi-threaded version of radix_sort. The input is cut into one contiguous block per thread; every pass counts
+// the digits of each block in parallel, a prefix sum over (bucket, block) gives every block its own output offsets,
+// and then the blocks scatter in parallel. Blocks are laid out in input order within every bucket, so the result is
+// exactly the stable sort radix_sort produces, whatever the number of threads.
+void parallel_radix_sort(t_thread_pool& pool, std::vector<uint32_t>& keys, std::vector<int>& values, std::vector<uint32_t>& key_buffer, std::vector<int>& value_buffer) {
+	int count = static_cast<int>(keys.size());
+	int block_count = std::min(static_cast<int>(pool.workers.size()) + 1, count / PARALLEL_GRAIN);
+	if (block_count < 2) {
+		radix_sort(keys, values, key_buffer, value_buffer);
+		return;
+	}
+	key_buffer.resize(count);
+	value_buffer.resize(count);
+
+	std::vector<int> block_histograms(block_count * 256);
+	auto block_begin = [&](int block) { return static_cast<int>(static_cast<long long>(count) * block / block_count); };
+
+	// the digit totals do not change when the keys are permuted, so one count up front tells which passes to skip
+	std::vector<int> digit_totals(block_count * 4 * 256);
+	parallel_for(pool, block_count, [&](int begin, int end) {
+		for (int block = begin; block < end; block++) {
+			int* totals = &digit_totals[block * 4 * 256];
+			for (int k = block_begin(block); k < block_begin(block + 1); k++) {
+				for (int digit = 0; digit < 4; digit++)
+					totals[digit * 256 + ((keys[k] >> (8 * digit)) & 0xFF)]++;
+			}
+		}
+	}, 1);
+
+	for (int digit = 0; digit < 4; digit++) {
+		int first_bucket = (keys[0] >> (8 * digit)) & 0xFF;
+		int first_bucket_total = 0;
+		for (int block = 0; block < block_count; block++)
+			first_bucket_total += digit_totals[(block * 4 + digit) * 256 + first_bucket];
+		if (first_bucket_total == count)
+			continue;
+
+		parallel_for(pool, block_count, [&](int begin, int end) {
+			for (int block = begin; block < end; block++) {
+				int* histogram = &block_histograms[block * 256];
+				std::fill(histogram, histogram + 256, 0);
+				for (int k = block_begin(block); k < block_begin(block + 1); k++)
+					histogram[(keys[k] >> (8 * digit)) & 0xFF]++;
+			}
+		}, 1);
+
+		// exclusive prefix sum, bucket-major so that within a bucket the blocks keep their input order
+		int offset = 0;
+		for (int bucket = 0; bucket < 256; bucket++) {
+			for (int block = 0; block < block_count; block++) {
+				int bucket_count = block_histograms[block * 256 + bucket];
+				block_histograms[block * 256 + bucket] = offset;
+				offset += bucket_count;
+			}
+		}
+
+		parallel_for(pool, block_count, [&](int begin, int end) {
+			for (int block = begin; block < end; block++) {
+				int* histogram = &block_histograms[block * 256];
+				for (int k = block_begin(block); k < block_begin(block + 1); k++) {
+					int destination = histogram[(keys[k] >> (8 * digit)) & 0xFF]++;
+					key_buffer[destination] = keys[k];
+					value_buffer[destination] = values[k];
+				}
+			}
+		}, 1);
+		keys.swap(key_buffer);
+		values.swap(value_buffer);
+	}
+}
+
+// Times parallel_radix_sort on triangle_count random depth keys with 1 up to all hardware threads,
+// and checks that every thread count gives the same order.
+void benchmark_sort(int triangle_count) {
+	std::mt19937 generator(42);
+	std::uniform_real_distribution<float> depth(0.0f, 3000.0f);
+	std::vector<uint32_t> input_keys(triangle_count);
+	for (uint32_t& key : input_keys)
+		key = depth_sort_key(depth(generator));
+
+	std::vector<int> reference;
+	double single_thread_time = 0.0;
+	int max_threads = std::max(1u, std::thread::hardware_concurrency());
+
+	printf("sorting %d depth keys\n", triangle_count);
+	for (int threads = 1; threads <= max_threads; threads++) {
+		t_thread_pool pool;
+		thread_pool_start(pool, threads);
+
+		std::vector<uint32_t> keys, key_buffer;
+		std::vector<int> values, value_buffer;
+		double best_time = INFINITY;
+		for (int run = 0; run < 5; run++) {
+			keys = input_keys;
+			values.resize(triangle_count);
+			for (int k = 0; k < triangle_count; k++)
+				values[k] = k;
+
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			parallel_radix_sort(pool, keys, values, key_buffer, value_buffer);
+			std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+			best_time = std::min(best_time, elapsed.count());
+		}
+		thread_pool_stop(pool);
+
+		if (threads == 1) {
+			reference = values;
+			single_thread_time = best_time;
+		}
+		printf("threads %2d: %8.3f ms, speedup %5.2fx%s\n", threads, best_time, single_thread_time / best_time,
+			values == reference ? "" : ", ORDER DIFFERS FROM 1 THREAD");
+	}
+}
+
+// fills index_list from the triangles in sort_triangles, in order
+void write_index_list(t_frame& frame) {
+	int count = static_cast<int>(frame.sort_triangles.size());
+	frame.index_list.resize(3 * count);
+	for (int k = 0; k < count; k++) {
+		int first_point = 3 * frame.sort_triangles[k]; // by convention the next points of the triangle follow it
+		frame.index_list[3 * k] = first_point;
+		frame.index_list[3 * k + 1] = first_point + 1;
+		frame.index_list[3 * k + 2] = first_point + 2;
+	}
+}
+
+// only the triangles that survived culling during projection are sorted
+void depth_order(t_frame& frame) {
+	int count = static_cast<int>(frame.visible_triangles.size());
+	frame.sort_keys.resize(count);
+	frame.sort_triangles.resize(count);
+	for (int k = 0; k < count; k++) {
+		int t = frame.visible_triangles[k];
+		frame.sort_keys[k] = depth_sort_key(frame.depth_keys[t]);
+		frame.sort_triangles[k] = t;
+	}
+
+	if (count > 0)
+		parallel_radix_sort(thread_pool, frame.sort_keys, frame.sort_triangles, frame.sort_key_buffer, frame.sort_triangle_buffer);
+
+	write_index_list(frame);
+}
+
+// largest camera change between two frames for which last frame's order is repaired rather than sorted from scratch
+const float INCREMENTAL_SORT_MAX_ANGLE = 0.05f * M_PI;
+const float INCREMENTAL_SORT_MAX_ZOOM = 1.25f;
+// the repair gives up and sorts from scratch once it has moved this many entries per triangle
+const int INCREMENTAL_SORT_MAX_MOVES = 8;
+
+// Stable insertion sort of (key, value) pairs, linear on nearly sorted input. Returns false once more than max_moves
+// entries had to be moved, the pairs are then a partly sorted permutation of the input.
+bool insertion_sort(std::vector<uint32_t>& keys, std::vector<int>& values, long long max_moves) {
+	long long moves = 0;
+	for (int k = 1; k < static_cast<int>(keys.size()); k++) {
+		uint32_t key = keys[k];
+		int value = values[k];
+		int position = k;
+		while (position > 0 && keys[position - 1] > key) {
+			keys[position] = keys[position - 1];
+			values[position] = values[position - 1];
+			position--;
+		}
+		keys[position] = key;
+		values[position] = value;
+
+		moves += k - position;
+		if (moves > max_moves)
+			return false;
+	}
+	return true;
+}
+
+// Depth order that starts from last frame's order. The triangles that stay visible keep their old order and are
+// repaired with an insertion sort, the ones that just came into view are radix sorted on their own and merged in.
+// A big camera jump, or a repair that turns out to be too much work, falls back to depth_order.
+void incremental_depth_order(t_frame& frame, const t_view& view) {
+	bool coherent = frame.previous_order_valid;
+	if (coherent) {
+		float angle = acos(std::clamp(view.camera_position.normalized().dot(frame.previous_camera_position.normalized()), -1.0f, 1.0f));
+		float zoom = view.camera_position.norm() / frame.previous_camera_position.norm();
+		coherent = angle <= INCREMENTAL_SORT_MAX_ANGLE && zoom <= INCREMENTAL_SORT_MAX_ZOOM && zoom >= 1.0f / INCREMENTAL_SORT_MAX_ZOOM;
+	}
+
+	if (static_cast<int>(frame.sort_stamps.size()) != frame.first_clipped_triangle) {
+		frame.sort_stamps.assign(frame.first_clipped_triangle, 0);
+		frame.sort_stamp = 0;
+		coherent = false;
+	}
+
+	if (coherent) {
+		// stamp marks the triangles visible this frame, stamp + 1 the ones of those that were also in last frame's order
+		uint32_t stamp = frame.sort_stamp += 2;
+		for (int t : frame.visible_triangles) {
+			if (t < frame.first_clipped_triangle)
+				frame.sort_stamps[t] = stamp;
+		}
+
+		frame.sort_keys.clear();
+		frame.sort_triangles.clear();
+		for (int t : frame.previous_order) {
+			if (frame.sort_stamps[t] == stamp) {
+				frame.sort_stamps[t] = stamp + 1;
+				frame.sort_keys.push_back(depth_sort_key(frame.depth_keys[t]));
+				frame.sort_triangles.push_back(t);
+			}
+		}
+
+		frame.fresh_keys.clear();
+		frame.fresh_triangles.clear();
+		for (int t : frame.visible_triangles) {
+			if (t >= frame.first_clipped_triangle || frame.sort_stamps[t] == stamp) {
+				frame.fresh_keys.push_back(depth_sort_key(frame.depth_keys[t]));
+				frame.fresh_triangles.push_back(t);
+			}
+		}
+
+		long long max_moves = static_cast<long long>(INCREMENTAL_SORT_MAX_MOVES) * frame.sort_keys.size();
+		coherent = insertion_sort(frame.sort_keys, frame.sort_triangles, max_moves);
+	}
+
+	if (!coherent) {
+		depth_order(frame);
+	} else {
+		if (!frame.fresh_keys.empty())
+			parallel_radix_sort(thread_pool, frame.fresh_keys, frame.fresh_triangles, frame.sort_key_buffer, frame.sort_triangle_buffer);
+
+		// merge the repaired and the fresh triangles, on equal keys the repaired ones go first
+		int count = static_cast<int>(frame.sort_keys.size() + frame.fresh_keys.size());
+		frame.sort_key_buffer.resize(count);
+		frame.sort_triangle_buffer.resize(count);
+		int a = 0, b = 0;
+		for (int k = 0; k < count; k++) {
+			bool take_fresh = a == static_cast<int>(frame.sort_keys.size())
+				|| (b < static_cast<int>(frame.fresh_keys.size()) && frame.fresh_keys[b] < frame.sort_keys[a]);
+			if (take_fresh) {
+				frame.sort_key_buffer[k] = frame.fresh_keys[b];
+				frame.sort_triangle_buffer[k] = frame.fresh_triangles[b++];
+			} else {
+				frame.sort_key_buffer[k] = frame.sort_keys[a];
+				frame.sort_triangle_buffer[k] = frame.sort_triangles[a++];
+			}
+		}
+		frame.sort_keys.swap(frame.sort_key_buffer);
+		frame.sort_triangles.swap(frame.sort_triangle_buffer);
+
+		write_index_list(frame);
+	}
+
+	// clipped pieces only live for one frame, so only mesh triangles are remembered
+	frame.previous_order.clear();
+	for (int t : frame.sort_triangles) {
+		if (t < frame.first_clipped_triangle)
+			frame.previous_order.push_back(t);
+	}
+	frame.previous_camera_position = view.camera_position;
+	frame.previous_order_valid = true;
+}
+
+// a run of quad rows or columns of the grid, walked from first to last (inclusive) in steps of +1 or -1
+typedef struct s_grid_range {
+	int first, last, step;
+} t_grid_range;
+
+// pushes triangle t and any pieces clipping split off it
+inline void push_triangle(const t_frame& frame, int t, std::vector<int>& index_list) {
+	if (frame.triangle_flags[t] & TRIANGLE_VISIBLE) {
+		index_list.push_back(3 * t);
+		index_list.push_back(3 * t + 1);
+		index_list.push_back(3 * t + 2);
+	}
+	if (frame.triangle_flags[t] & TRIANGLE_HAS_PIECES) {
+		std::vector<int>::const_iterator piece = std::lower_bound(frame.clipped_parents.begin(), frame.clipped_parents.end(), t);
+		for (; piece != frame.clipped_parents.end() && *piece == t; ++piece) {
+			int piece_triangle = frame.first_clipped_triangle + static_cast<int>(piece - frame.clipped_parents.begin());
+			index_list.push_back(3 * piece_triangle);
+			index_list.push_back(3 * piece_triangle + 1);
+			index_list.push_back(3 * piece_triangle + 2);
+		}
+	}
+}
+
+// walks the quads of one quadrant chunk by chunk, every quad is visited after all quads further from the camera
+void grid_order_quadrant(const t_mesh& mesh, const t_frame& frame, t_grid_range rows, t_grid_range columns, float camera_diagonal, std::vector<int>& index_list) {
+	if ((rows.last - rows.first) * rows.step < 0 || (columns.last - columns.first) * columns.step < 0)
+		return; // empty quadrant
+
+	for (int chunk_row = rows.first / CHUNK_SIZE; chunk_row != rows.last / CHUNK_SIZE + rows.step; chunk_row += rows.step) {
+		for (int chunk_column = columns.first / CHUNK_SIZE; chunk_column != columns.last / CHUNK_SIZE + columns.step; chunk_column += columns.step) {
+			int chunk_index = chunk_row * mesh.chunk_columns + chunk_column;
+			if (!frame.chunk_visible[chunk_index])
+				continue;
+			const t_chunk& chunk = mesh.chunks[chunk_index];
+
+			// the part of the quadrant inside this chunk
+			int row_begin = rows.step > 0 ? std::max(rows.first, chunk.first_row) : std::min(rows.first, chunk.first_row + chunk.rows - 1);
+			int row_end = rows.step > 0 ? std::min(rows.last, chunk.first_row + chunk.rows - 1) : std::max(rows.last, chunk.first_row);
+			int column_begin = columns.step > 0 ? std::max(columns.first, chunk.first_column) : std::min(columns.first, chunk.first_column + chunk.columns - 1);
+			int column_end = columns.step > 0 ? std::min(columns.last, chunk.first_column + chunk.columns - 1) : std::max(columns.last, chunk.first_column);
+
+			for (int row = row_begin; row != row_end + rows.step; row += rows.step) {
+				for (int column = column_begin; column != column_end + columns.step; column += columns.step) {
+					int t = chunk.first_triangle + 2 * ((row - chunk.first_row) * chunk.columns + (column - chunk.first_column));
+					// the first triangle holds corner (row, column), the diagonal between the two runs along row + column + 1
+					if (camera_diagonal < row + column + 1) {
+						push_triangle(frame, t + 1, index_list);
+						push_triangle(frame, t, index_list);
+					} else {
+						push_triangle(frame, t, index_list);
+						push_triangle(frame, t + 1, index_list);
+					}
+				}
+			}
+		}
+	}
+}
+
+// Painter's order without sorting. Looking at the grid from above, a quad can only be hidden by quads that lie between
+// it and the camera's ground point, i.e. that are no further away along either axis. So walking rows and columns from
+// the far edge towards the camera draws everything back to front. The vertical planes through the camera split the
+// grid into four quadrants that cannot overlap on screen; the row and column holding the camera are walked last.
+void grid_order(const t_mesh& mesh, const t_view& view, const t_frame& frame, std::vector<int>& index_list) {
+	index_list.clear();
+
+	float camera_row = (view.camera_position.x() - mesh.grid_origin.x()) / mesh.cell_size.x();
+	float camera_column = (view.camera_position.y() - mesh.grid_origin.y()) / mesh.cell_size.y();
+	int split_row = std::clamp(static_cast<int>(std::floor(camera_row)), 0, mesh.rows);
+	int split_column = std::clamp(static_cast<int>(std::floor(camera_column)), 0, mesh.columns);
+
+	t_grid_range row_halves[2] = { { 0, split_row - 1, 1 }, { mesh.rows - 1, split_row, -1 } };
+	t_grid_range column_halves[2] = { { 0, split_column - 1, 1 }, { mesh.columns - 1, split_column, -1 } };
+
+	for (const t_grid_range& rows : row_halves) {
+		for (const t_grid_range& columns : column_halves)
+			grid_order_quadrant(mesh, frame, rows, columns, camera_row + camera_column, index_list);
+	}
+}
+
+// Margin in pixels on both sides of the horizon test: pixel centers this close to an edge may go either way once the
+// rasterizer snaps verticies (1/32 pixel at most) or breaks ties between triangles sharing an edge
+const float HORIZON_EPSILON = 0.05f;
+
+// the y range of triangle v along the vertical line at x, returns false if the line misses it
+inline bool triangle_column_span(const SDL_Vertex* v, float x, float& top, float& bottom) {
+	top = INFINITY;
+	bottom = -INFINITY;
+	for (int k = 0; k < 3; k++) {
+		const SDL_FPoint& p = v[k].position;
+		const SDL_FPoint& q = v[(k + 1) % 3].position;
+		if (x < std::min(p.x, q.x) || x > std::max(p.x, q.x))
+			continue;
+		if (p.x == q.x) {
+			top = std::min({ top, p.y, q.y });
+			bottom = std::max({ bottom, p.y, q.y });
+		} else {
+			float y = p.y + (x - p.x) / (q.x - p.x) * (q.y - p.y);
+			top = std::min(top, y);
+			bottom = std::max(bottom, y);
+		}
+	}
+	return top <= bottom;
+}
+
+// Floating horizon occlusion culling on top of the grid order. Walking index_list backwards visits the triangles front
+// to back, and every screen column remembers one run of pixel rows [horizon_top, horizon_bottom] that is already
+// covered. Looking down at terrain, that run starts at the bottom of the screen and grows upwards like a horizon. A
+// triangle whose pixels all lie inside the runs of their columns can only be behind what was drawn (the grid order puts
+// anything overlapping it in front), so it is dropped. The remaining triangles keep their back to front order.
+void horizon_cull(const t_view& view, t_frame& frame) {
+	int width = view.viewport_width, height = view.viewport_height;
+	frame.horizon_top.assign(width, height);
+	frame.horizon_bottom.assign(width, -1);
+	std::vector<int>& index_list = frame.index_list;
+	int triangle_count = static_cast<int>(index_list.size()) / 3;
+
+	// culled triangles are marked with -1 and compacted away afterwards
+	for (int k = triangle_count - 1; k >= 0; k--) {
+		const SDL_Vertex* v = &frame.sdl_verticies[index_list[3 * k]];
+		float min_x = std::min({ v[0].position.x, v[1].position.x, v[2].position.x });
+		float max_x = std::max({ v[0].position.x, v[1].position.x, v[2].position.x });
+		// pixel columns whose centers the triangle might touch, widened by the margin
+		int first_column = std::max(0, static_cast<int>(std::ceil(min_x - 0.5f - HORIZON_EPSILON)));
+		int last_column = std::min(width - 1, static_cast<int>(std::floor(max_x - 0.5f + HORIZON_EPSILON)));
+
+		bool hidden = true;
+		for (int x = first_column; x <= last_column && hidden; x++) {
+			float top, bottom;
+			if (!triangle_column_span(v, std::clamp(x + 0.5f, min_x, max_x), top, bottom))
+				continue;
+			int first_row = std::max(0, static_cast<int>(std::ceil(top - 0.5f - HORIZON_EPSILON)));
+			int last_row = std::min(height - 1, static_cast<int>(std::floor(bottom - 0.5f + HORIZON_EPSILON)));
+			hidden = first_row > last_row || (first_row >= frame.horizon_top[x] && last_row <= frame.horizon_bottom[x]);
+		}
+		if (hidden) {
+			index_list[3 * k] = -1;
+			continue;
+		}
+
+		// grow the horizon by the pixels this triangle surely covers, narrowed by the margin
+		for (int x = first_column; x <= last_column; x++) {
+			float top, bottom;
+			if (!triangle_column_span(v, x + 0.5f, top, bottom))
+				continue;
+			int first_row = std::max(0, static_cast<int>(std::ceil(top - 0.5f + HORIZON_EPSILON)));
+			int last_row = std::min(height - 1, static_cast<int>(std::floor(bottom - 0.5f - HORIZON_EPSILON)));
+			if (first_row > last_row)
+				continue;
+			int& horizon_top = frame.horizon_top[x];
+			int& horizon_bottom = frame.horizon_bottom[x];
+			if (first_row <= horizon_bottom + 1 && last_row >= horizon_top - 1) {
+				horizon_top = std::min(horizon_top, first_row);
+				horizon_bottom = std::max(horizon_bottom, last_row);
+			} else if (last_row - first_row > horizon_bottom - horizon_top) {
+				// a separate run, only one is remembered so keep the longer one
+				horizon_top = first_row;
+				horizon_bottom = last_row;
+			}
+		}
+	}
+
+	int kept = 0;
+	for (int k = 0; k < triangle_count; k++) {
+		if (index_list[3 * k] < 0)
+			continue;
+		index_list[3 * kept] = index_list[3 * k];
+		index_list[3 * kept + 1] = index_list[3 * k + 1];
+		index_list[3 * kept + 2] = index_list[3 * k + 2];
+		kept++;
+	}
+	index_list.resize(3 * kept);
+}
+
+inline uint32_t pack_color(uint8_t r, uint8_t g, uint8_t b) {
+	uint8_t bytes[4] = { r, g, b, 0xFF };
+	uint32_t packed;
+	memcpy(&packed, bytes, sizeof(packed));
+	return packed;
+}
+
+// the software rasterizer splits the framebuffer into square tiles of this many pixels
+const int TILE_SIZE = 64;
+
+// The region of a framebuffer one rasterizer call may write to: a tile's pixels in the shared color buffer and the
+// depth of that tile, which every thread keeps to itself while it works on the tile.
+typedef struct s_raster_tile {
+	int min_x, min_y, max_x, max_y; // inclusive pixel bounds in framebuffer coordinates
+	uint32_t* color; // pixel (min_x, min_y) of the framebuffer
+	int color_stride;
+	float* depth; // depth of pixel (min_x, min_y)
+	int depth_stride;
+	bool depth_only = false; // the color is neither interpolated nor written
+	bool edge_overlay = false; // pixels near a triangle edge are darkened
+} t_raster_tile;
+
+// the overlaid edges fade out over this many pixels on either side of the edge
+const float EDGE_OVERLAY_WIDTH = 1.0f;
+// how much of the color is left right on an edge
+const float EDGE_OVERLAY_DARKEN = 0.35f;
+
+// color factor of a pixel the given distance in pixels from its triangle's nearest edge
+inline float edge_overlay_factor(float distance) {
+	return EDGE_OVERLAY_DARKEN + (1.0f - EDGE_OVERLAY_DARKEN) * std::min(1.0f, distance * (1.0f / EDGE_OVERLAY_WIDTH));
+}
+
+// Z-buffered scan of the triangle's bounding box with float edge functions, restricted to one tile. 1 / w is linear in
+// screen space, so it is interpolated directly; colors are interpolated like SDL_RenderGeometry does (Gouraud, not
+// perspective corrected). Only used for triangles too large for the fixed point path in rasterize_triangle.
+void rasterize_triangle_float(const t_raster_tile& tile, const SDL_Vertex* verticies, const float* inverse_depths) {
+	const SDL_Vertex* v[3] = { &verticies[0], &verticies[1], &verticies[2] };
+	float w[3] = { inverse_depths[0], inverse_depths[1], inverse_depths[2] };
+
+	float area = (v[1]->position.x - v[0]->position.x) * (v[2]->position.y - v[0]->position.y)
+		- (v[1]->position.y - v[0]->position.y) * (v[2]->position.x - v[0]->position.x);
+	if (area < 0.0f) {
+		// backfaces are only here if culling is off, flip them so the edge functions below are positive inside
+		std::swap(v[1], v[2]);
+		std::swap(w[1], w[2]);
+		area = -area;
+	}
+	if (area <= 0.0f)
+		return;
+
+	int min_x = std::max(tile.min_x, static_cast<int>(std::floor(std::min({ v[0]->position.x, v[1]->position.x, v[2]->position.x }))));
+	int max_x = std::min(tile.max_x, static_cast<int>(std::ceil(std::max({ v[0]->position.x, v[1]->position.x, v[2]->position.x }))));
+	int min_y = std::max(tile.min_y, static_cast<int>(std::floor(std::min({ v[0]->position.y, v[1]->position.y, v[2]->position.y }))));
+	int max_y = std::min(tile.max_y, static_cast<int>(std::ceil(std::max({ v[0]->position.y, v[1]->position.y, v[2]->position.y }))));
+
+	// edge k is opposite vertex k, its function is positive inside and equals area at vertex k
+	float step_x[3], step_y[3], row_start[3];
+	float start_x = min_x + 0.5f, start_y = min_y + 0.5f; // pixel centers
+	for (int k = 0; k < 3; k++) {
+		const SDL_FPoint& a = v[(k + 1) % 3]->position;
+		const SDL_FPoint& b = v[(k + 2) % 3]->position;
+		step_x[k] = -(b.y - a.y);
+		step_y[k] = b.x - a.x;
+		row_start[k] = (b.x - a.x) * (start_y - a.y) - (b.y - a.y) * (start_x - a.x);
+	}
+
+	// the edge functions divided by the edge lengths are the distances to the edges in pixels
+	float inverse_length[3];
+	for (int k = 0; k < 3; k++)
+		inverse_length[k] = 1.0f / std::sqrt(step_x[k] * step_x[k] + step_y[k] * step_y[k]);
+
+	float inverse_area = 1.0f / area;
+	for (int y = min_y; y <= max_y; y++) {
+		float e[3] = { row_start[0], row_start[1], row_start[2] };
+		uint32_t* color_row = tile.color + (y - tile.min_y) * tile.color_stride - tile.min_x;
+		float* depth_row = tile.depth + (y - tile.min_y) * tile.depth_stride - tile.min_x;
+
+		for (int x = min_x; x <= max_x; x++) {
+			if (e[0] >= 0.0f && e[1] >= 0.0f && e[2] >= 0.0f) {
+				float b0 = e[0] * inverse_area, b1 = e[1] * inverse_area, b2 = e[2] * inverse_area;
+				float depth = b0 * w[0] + b1 * w[1] + b2 * w[2];
+				if (depth > depth_row[x]) {
+					depth_row[x] = depth;
+					float factor = 1.0f;
+					if (tile.edge_overlay)
+						factor = edge_overlay_factor(std::min({ e[0] * inverse_length[0], e[1] * inverse_length[1], e[2] * inverse_length[2] }));
+					if (!tile.depth_only)
+						color_row[x] = pack_color(static_cast<uint8_t>(factor * (b0 * v[0]->color.r + b1 * v[1]->color.r + b2 * v[2]->color.r)),
+							static_cast<uint8_t>(factor * (b0 * v[0]->color.g + b1 * v[1]->color.g + b2 * v[2]->color.g)),
+							static_cast<uint8_t>(factor * (b0 * v[0]->color.b + b1 * v[1]->color.b + b2 * v[2]->color.b)));
+				}
+			}
+			for (int k = 0; k < 3; k++)
+				e[k] += step_x[k];
+		}
+		for (int k = 0; k < 3; k++)
+			row_start[k] += step_y[k];
+	}
+}
+
+// snapped vertex positions have 1/16 pixel precision
+const int SUBPIXEL_BITS = 4;
+const int SUBPIXEL_ONE = 1 << SUBPIXEL_BITS;
+// the fixed point path needs the snapped triangle to span less than this many subpixels, so that edge functions stay
+// within 32 bits inside any block an edge crosses
+const int64_t GUARD_BAND = int64_t(1) << 17;
+// coverage is first decided for square blocks of this many pixels
+const int RASTER_BLOCK = 8;
+
+// E(x, y) = a * x + b * y + c at subpixel position (x, y), positive inside the triangle
+typedef struct s_raster_edge {
+	int64_t a, b, c;
+	int bias; // 0 on top-left edges, -1 on the others, so pixels exactly on a shared edge go to exactly one triangle
+} t_raster_edge;
+
+// attribute(x, y) = base + dx * x + dy * y at the center of pixel (x, y)
+typedef struct s_raster_plane {
+	float base, dx, dy;
+} t_raster_plane;
+
+// Depth tests and writes one row of up to 8 pixels of a block. e holds, per partial edge, the biased edge value at the
+// first pixel of the row and the per pixel step; a pixel is covered when all of them are >= 0. planes are 1 / w, the
+// three color channels and, for the edge overlay, the distances in pixels to the three edges.
+inline void shade_block_row(const t_raster_tile& tile, int x, int y, int lane_count, int partial_count, const int32_t* e, const int32_t* e_step, const t_raster_plane* planes) {
+	float* depth_row = tile.depth + (y - tile.min_y) * tile.depth_stride + (x - tile.min_x);
+	uint32_t* color_row = tile.color + (y - tile.min_y) * tile.color_stride + (x - tile.min_x);
+#ifdef __AVX2__
+	// eight pixels per instruction
+	const __m256i lane_index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i covered = _mm256_cmpgt_epi32(_mm256_set1_epi32(lane_count), lane_index);
+	for (int k = 0; k < partial_count; k++) {
+		__m256i value = _mm256_add_epi32(_mm256_set1_epi32(e[k]), _mm256_mullo_epi32(_mm256_set1_epi32(e_step[k]), lane_index));
+		covered = _mm256_and_si256(covered, _mm256_cmpgt_epi32(value, _mm256_set1_epi32(-1)));
+	}
+	if (_mm256_testz_si256(covered, covered))
+		return;
+
+	__m256 px = _mm256_add_ps(_mm256_set1_ps(static_cast<float>(x)), _mm256_cvtepi32_ps(lane_index));
+	__m256 py = _mm256_set1_ps(static_cast<float>(y));
+	__m256 attributes[4];
+	attributes[0] = _mm256_fmadd_ps(_mm256_set1_ps(planes[0].dy), py, _mm256_fmadd_ps(_mm256_set1_ps(planes[0].dx), px, _mm256_set1_ps(planes[0].base)));
+
+	// x is not aligned to the block, so a full load could read past the end of the depth tile
+	__m256 old_depth = _mm256_maskload_ps(depth_row, covered);
+	__m256i pass = _mm256_and_si256(covered, _mm256_castps_si256(_mm256_cmp_ps(attributes[0], old_depth, _CMP_GT_OQ)));
+	if (_mm256_testz_si256(pass, pass))
+		return;
+	_mm256_maskstore_ps(depth_row, pass, attributes[0]);
+	if (tile.depth_only)
+		return;
+	for (int k = 1; k < 4; k++)
+		attributes[k] = _mm256_fmadd_ps(_mm256_set1_ps(planes[k].dy), py, _mm256_fmadd_ps(_mm256_set1_ps(planes[k].dx), px, _mm256_set1_ps(planes[k].base)));
+	if (tile.edge_overlay) {
+		__m256 distance = _mm256_set1_ps(INFINITY);
+		for (int k = 4; k < 7; k++)
+			distance = _mm256_min_ps(distance, _mm256_fmadd_ps(_mm256_set1_ps(planes[k].dy), py, _mm256_fmadd_ps(_mm256_set1_ps(planes[k].dx), px, _mm256_set1_ps(planes[k].base))));
+		__m256 fade = _mm256_min_ps(_mm256_set1_ps(1.0f), _mm256_mul_ps(distance, _mm256_set1_ps(1.0f / EDGE_OVERLAY_WIDTH)));
+		__m256 factor = _mm256_fmadd_ps(fade, _mm256_set1_ps(1.0f - EDGE_OVERLAY_DARKEN), _mm256_set1_ps(EDGE_OVERLAY_DARKEN));
+		for (int k = 1; k < 4; k++)
+			attributes[k] = _mm256_mul_ps(attributes[k], factor);
+	}
+
+	// colors are packed as bytes R, G, B, A
+	const __m256 zero = _mm256_setzero_ps(), max_channel = _mm256_set1_ps(255.0f);
+	__m256i r = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(attributes[1], zero), max_channel));
+	__m256i g = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(attributes[2], zero), max_channel));
+	__m256i b = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(attributes[3], zero), max_channel));
+	__m256i packed = _mm256_or_si256(_mm256_or_si256(r, _mm256_slli_epi32(g, 8)), _mm256_or_si256(_mm256_slli_epi32(b, 16), _mm256_set1_epi32(static_cast<int>(0xFF000000u))));
+	_mm256_maskstore_epi32(reinterpret_cast<int*>(color_row), pass, packed);
+#else
+	for (int lane = 0; lane < lane_count; lane++) {
+		bool covered = true;
+		for (int k = 0; k < partial_count; k++)
+			covered &= e[k] + lane * e_step[k] >= 0;
+		if (!covered)
+			continue;
+
+		float px = static_cast<float>(x + lane), py = static_cast<float>(y);
+		float depth = planes[0].base + planes[0].dx * px + planes[0].dy * py;
+		if (depth <= depth_row[lane])
+			continue;
+		depth_row[lane] = depth;
+		if (tile.depth_only)
+			continue;
+
+		float factor = 1.0f;
+		if (tile.edge_overlay) {
+			float distance = INFINITY;
+			for (int k = 4; k < 7; k++)
+				distance = std::min(distance, planes[k].base + planes[k].dx * px + planes[k].dy * py);
+			factor = edge_overlay_factor(distance);
+		}
+		float channels[3];
+		for (int k = 0; k < 3; k++)
+			channels[k] = std::clamp(factor * (planes[k + 1].base + planes[k + 1].dx * px + planes[k + 1].dy * py), 0.0f, 255.0f);
+		color_row[lane] = pack_color(static_cast<uint8_t>(channels[0]), static_cast<uint8_t>(channels[1]), static_cast<uint8_t>(channels[2]));
+	}
+#endif
+}
+
+// Half-space rasterizer. Vertices are snapped to 1/16 pixel and the edge functions are evaluated exactly in integers
+// with a top-left fill rule, so triangles sharing an edge neither overlap nor leave gaps. The bounding box is walked
+// in 8x8 blocks: an edge that misses a block rejects it, edges that fully contain it are not tested per pixel, and the
+// remaining ones are tested for 8 pixels at a time (with AVX2 when the compiler targets it). Depth (1 / w) and color
+// are interpolated from their plane equations, which gives the same Gouraud shading as SDL_RenderGeometry.
+// The edge overlay divides the three edge functions by their lengths, which turns them into planes of the distance in
+// pixels to each edge; a pixel close to the nearest one is darkened in the same pass. Only pixels that pass the depth
+// test are shaded, so only visible edges show.
+void rasterize_triangle(const t_raster_tile& tile, const SDL_Vertex* verticies, const float* inverse_depths) {
+	int64_t sx[3], sy[3];
+	for (int k = 0; k < 3; k++) {
+		if (!(abs(verticies[k].position.x) < 1e6f && abs(verticies[k].position.y) < 1e6f)) {
+			rasterize_triangle_float(tile, verticies, inverse_depths);
+			return;
+		}
+		sx[k] = std::llround(verticies[k].position.x * SUBPIXEL_ONE);
+		sy[k] = std::llround(verticies[k].position.y * SUBPIXEL_ONE);
+	}
+	int64_t snapped_min_x = std::min({ sx[0], sx[1], sx[2] }), snapped_max_x = std::max({ sx[0], sx[1], sx[2] });
+	int64_t snapped_min_y = std::min({ sy[0], sy[1], sy[2] }), snapped_max_y = std::max({ sy[0], sy[1], sy[2] });
+	if (snapped_max_x - snapped_min_x >= GUARD_BAND || snapped_max_y - snapped_min_y >= GUARD_BAND) {
+		rasterize_triangle_float(tile, verticies, inverse_depths);
+		return;
+	}
+
+	int order[3] = { 0, 1, 2 };
+	int64_t area = (sx[1] - sx[0]) * (sy[2] - sy[0]) - (sy[1] - sy[0]) * (sx[2] - sx[0]);
+	if (area < 0) {
+		// backfaces are only here if culling is off, flip them so the edge functions are positive inside
+		std::swap(order[1], order[2]);
+		area = -area;
+	}
+	if (area == 0)
+		return; // degenerate once snapped
+
+	// edge k runs between the two verticies other than order[k]
+	t_raster_edge edges[3];
+	for (int k = 0; k < 3; k++) {
+		int from = order[(k + 1) % 3], to = order[(k + 2) % 3];
+		int64_t dx = sx[to] - sx[from], dy = sy[to] - sy[from];
+		edges[k].a = -dy;
+		edges[k].b = dx;
+		edges[k].c = dy * sx[from] - dx * sy[from];
+		// y points down, so the inside is below a top edge (dy == 0, dx > 0) and right of a left edge (dy < 0)
+		edges[k].bias = (dy == 0 && dx > 0) || dy < 0 ? 0 : -1;
+	}
+
+	// plane equations of 1 / w and the color channels over pixel coordinates, from the snapped positions
+	float x0 = sx[0] / static_cast<float>(SUBPIXEL_ONE), y0 = sy[0] / static_cast<float>(SUBPIXEL_ONE);
+	float dx1 = sx[1] / static_cast<float>(SUBPIXEL_ONE) - x0, dy1 = sy[1] / static_cast<float>(SUBPIXEL_ONE) - y0;
+	float dx2 = sx[2] / static_cast<float>(SUBPIXEL_ONE) - x0, dy2 = sy[2] / static_cast<float>(SUBPIXEL_ONE) - y0;
+	float inverse_determinant = 1.0f / (dx1 * dy2 - dx2 * dy1);
+	float values[4][3];
+	for (int k = 0; k < 3; k++) {
+		values[0][k] = inverse_depths[k];
+		values[1][k] = verticies[k].color.r;
+		values[2][k] = verticies[k].color.g;
+		values[3][k] = verticies[k].color.b;
+	}
+	t_raster_plane planes[7];
+	for (int k = 0; k < 4; k++) {
+		float d1 = values[k][1] - values[k][0], d2 = values[k][2] - values[k][0];
+		planes[k].dx = (d1 * dy2 - d2 * dy1) * inverse_determinant;
+		planes[k].dy = (d2 * dx1 - d1 * dx2) * inverse_determinant;
+		// evaluated at pixel centers
+		planes[k].base = values[k][0] - planes[k].dx * (x0 - 0.5f) - planes[k].dy * (y0 - 0.5f);
+	}
+	if (tile.edge_overlay) {
+		for (int k = 0; k < 3; k++) {
+			// the edge function is in subpixels squared, its gradient is the edge's length in subpixels
+			double scale = 1.0 / (std::sqrt(static_cast<double>(edges[k].a * edges[k].a + edges[k].b * edges[k].b)) * SUBPIXEL_ONE);
+			planes[4 + k].dx = static_cast<float>(edges[k].a * SUBPIXEL_ONE * scale);
+			planes[4 + k].dy = static_cast<float>(edges[k].b * SUBPIXEL_ONE * scale);
+			planes[4 + k].base = static_cast<float>((edges[k].a * (SUBPIXEL_ONE / 2) + edges[k].b * (SUBPIXEL_ONE / 2) + edges[k].c) * scale);
+		}
+	}
+
+	// blocks are aligned to the tile, which is itself aligned to the block size
+	int min_x = std::max(tile.min_x, static_cast<int>(snapped_min_x >> SUBPIXEL_BITS));
+	int max_x = std::min(tile.max_x, static_cast<int>(snapped_max_x >> SUBPIXEL_BITS));
+	int min_y = std::max(tile.min_y, static_cast<int>(snapped_min_y >> SUBPIXEL_BITS));
+	int max_y = std::min(tile.max_y, static_cast<int>(snapped_max_y >> SUBPIXEL_BITS));
+	if (min_x > max_x || min_y > max_y)
+		return;
+	int first_block_x = min_x - (min_x - tile.min_x) % RASTER_BLOCK;
+	int first_block_y = min_y - (min_y - tile.min_y) % RASTER_BLOCK;
+
+	const int64_t block_span = (RASTER_BLOCK - 1) * SUBPIXEL_ONE;
+	for (int block_y = first_block_y; block_y <= max_y; block_y += RASTER_BLOCK) {
+		for (int block_x = first_block_x; block_x <= max_x; block_x += RASTER_BLOCK) {
+			// subpixel position of the center of the block's first pixel
+			int64_t origin_x = static_cast<int64_t>(block_x) * SUBPIXEL_ONE + SUBPIXEL_ONE / 2;
+			int64_t origin_y = static_cast<int64_t>(block_y) * SUBPIXEL_ONE + SUBPIXEL_ONE / 2;
+
+			int32_t row_value[3], step_x[3], step_y[3];
+			int partial_count = 0;
+			bool rejected = false;
+			for (int k = 0; k < 3 && !rejected; k++) {
+				const t_raster_edge& edge = edges[k];
+				int64_t value = edge.a * origin_x + edge.b * origin_y + edge.c + edge.bias;
+				// the smallest and largest value over the block's pixel centers
+				int64_t lowest = value + std::min<int64_t>(0, edge.a * block_span) + std::min<int64_t>(0, edge.b * block_span);
+				int64_t highest = value + std::max<int64_t>(0, edge.a * block_span) + std::max<int64_t>(0, edge.b * block_span);
+				if (highest < 0) {
+					rejected = true;
+				} else if (lowest < 0) {
+					// the edge crosses the block, so the values in it are small enough for 32 bits
+					row_value[partial_count] = static_cast<int32_t>(value);
+					step_x[partial_count] = static_cast<int32_t>(edge.a * SUBPIXEL_ONE);
+					step_y[partial_count] = static_cast<int32_t>(edge.b * SUBPIXEL_ONE);
+					partial_count++;
+				}
+			}
+			if (rejected)
+				continue;
+
+			// only the part of the block inside the triangle's bounding box is shaded, small triangles rarely cover a whole block
+			int x = std::max(block_x, min_x), y = std::max(block_y, min_y);
+			int lane_count = std::min(block_x + RASTER_BLOCK - 1, max_x) - x + 1;
+			int last_y = std::min(block_y + RASTER_BLOCK - 1, max_y);
+			for (int k = 0; k < partial_count; k++)
+				row_value[k] += (x - block_x) * step_x[k] + (y - block_y) * step_y[k];
+			for (; y <= last_y; y++) {
+				shade_block_row(tile, x, y, lane_count, partial_count, row_value, step_x, planes);
+				for (int k = 0; k < partial_count; k++)
+					row_value[k] += step_y[k];
+			}
+		}
+	}
+}
+
+// Draws the visible triangles of an already projected frame, the depth buffer takes care of visibility so no ordering
+// is needed. Triangles are first binned into the tiles their bounding box touches, each thread bins its own slice of
+// the triangles so binning needs no locks. Then the threads take whole tiles off a shared atomic counter; a tile is
+// only ever touched by one thread, which keeps its depth in a local buffer, so the framebuffer needs no locks either.
+// Every tile sees its triangles in the order of frame.visible_triangles, so the image does not depend on the thread count.
+// A depth only pass fills just the depth buffer and leaves the color untouched, for drawing lines against it.
+void rasterize_frame(t_thread_pool& pool, const t_view& view, t_frame& frame, t_framebuffer& framebuffer, bool depth_only = false) {
+	int width = view.viewport_width, height = view.viewport_height;
+	framebuffer.width = width;
+	framebuffer.height = height;
+	framebuffer.color.resize(width * height);
+	framebuffer.depth.resize(width * height);
+
+	int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+	int tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+	int tile_count = tiles_x * tiles_y;
+	int triangle_count = static_cast<int>(frame.visible_triangles.size());
+	int slice_count = std::max(1, std::min(static_cast<int>(pool.workers.size()) + 1, triangle_count / PARALLEL_GRAIN));
+
+	// bins are slice major, [slice * tile_count + tile], and keep their memory between frames
+	frame.tile_bins.resize(std::max(frame.tile_bins.size(), static_cast<size_t>(slice_count * tile_count)));
+	parallel_for(pool, slice_count, [&](int begin, int end) {
+		for (int slice = begin; slice < end; slice++) {
+			std::vector<int>* bins = &frame.tile_bins[slice * tile_count];
+			for (int tile = 0; tile < tile_count; tile++)
+				bins[tile].clear();
+
+			int first = static_cast<int>(static_cast<long long>(triangle_count) * slice / slice_count);
+			int last = static_cast<int>(static_cast<long long>(triangle_count) * (slice + 1) / slice_count);
+			for (int k = first; k < last; k++) {
+				int t = frame.visible_triangles[k];
+				const SDL_Vertex* v = &frame.sdl_verticies[3 * t];
+				float min_x = std::min({ v[0].position.x, v[1].position.x, v[2].position.x });
+				float max_x = std::max({ v[0].position.x, v[1].position.x, v[2].position.x });
+				float min_y = std::min({ v[0].position.y, v[1].position.y, v[2].position.y });
+				float max_y = std::max({ v[0].position.y, v[1].position.y, v[2].position.y });
+
+				int tile_min_x = std::max(0, static_cast<int>(std::floor(min_x)) / TILE_SIZE);
+				int tile_max_x = std::min(tiles_x - 1, static_cast<int>(std::ceil(max_x)) / TILE_SIZE);
+				int tile_min_y = std::max(0, static_cast<int>(std::floor(min_y)) / TILE_SIZE);
+				int tile_max_y = std::min(tiles_y - 1, static_cast<int>(std::ceil(max_y)) / TILE_SIZE);
+				for (int tile_y = tile_min_y; tile_y <= tile_max_y; tile_y++) {
+					for (int tile_x = tile_min_x; tile_x <= tile_max_x; tile_x++)
+						bins[tile_y * tiles_x + tile_x].push_back(t);
+				}
+			}
+		}
+	}, 1);
+
+	std::atomic<int> next_tile(0);
+	parallel_for(pool, static_cast<int>(pool.workers.size()) + 1, [&](int, int) {
+		float depth_tile[TILE_SIZE * TILE_SIZE];
+		for (int tile = next_tile++; tile < tile_count; tile = next_tile++) {
+			t_raster_tile target;
+			target.min_x = (tile % tiles_x) * TILE_SIZE;
+			target.min_y = (tile / tiles_x) * TILE_SIZE;
+			target.max_x = std::min(target.min_x + TILE_SIZE, width) - 1;
+			target.max_y = std::min(target.min_y + TILE_SIZE, height) - 1;
+			target.color = &framebuffer.color[target.min_y * width + target.min_x];
+			target.color_stride = width;
+			target.depth = depth_tile;
+			target.depth_stride = TILE_SIZE;
+			target.depth_only = depth_only;
+			target.edge_overlay = edge_overlay;
+
+			// clear to the same grey as the SDL path
+			uint32_t background = pack_color(0xC0, 0xC0, 0xC0);
+			for (int y = 0; y <= target.max_y - target.min_y && !depth_only; y++)
+				std::fill(target.color + y * width, target.color + y * width + target.max_x - target.min_x + 1, background);
+			std::fill(depth_tile, depth_tile + TILE_SIZE * TILE_SIZE, 0.0f);
+
+			for (int slice = 0; slice < slice_count; slice++) {
+				for (int t : frame.tile_bins[slice * tile_count + tile])
+					rasterize_triangle(target, &frame.sdl_verticies[3 * t], &frame.inverse_depths[3 * t]);
+			}
+
+			// the finished depth goes back to the framebuffer for anything drawn on top later
+			for (int y = 0; y <= target.max_y - target.min_y; y++)
+				memcpy(&framebuffer.depth[(target.min_y + y) * width + target.min_x], &depth_tile[y * TILE_SIZE], (target.max_x - target.min_x + 1) * sizeof(float));
+		}
+	}, 1);
+}
+
+// A line pixel is drawn if its 1 / w is at most this fraction behind the terrain's. The grid lines lie on the terrain,
+// so without some slack they would lose the depth test against the triangles they border about half the time.
+const float WIREFRAME_DEPTH_TOLERANCE = 0.01f;
+
+// limits the steps k of a line sampled at start + k * step to those with lowest <= start + k * step < highest
+inline void clip_line_steps(float start, float step, float lowest, float highest, float& first, float& last) {
+	if (step == 0.0f) {
+		if (start < lowest || start >= highest)
+			last = -1.0f;
+		return;
+	}
+	float a = (lowest - start) / step, b = (highest - start) / step;
+	first = std::max(first, std::min(a, b));
+	last = std::min(last, std::max(a, b));
+}
+
+// DDA over one segment, restricted to the rows min_y to max_y: one sample per pixel along the major axis, each depth
+// tested against the terrain before it is written. With AVX2 eight samples are tested at once, their depths gathered.
+void rasterize_segment(t_framebuffer& framebuffer, int min_y, int max_y, const t_line_segment& segment, uint32_t color) {
+	float dx = segment.x1 - segment.x0, dy = segment.y1 - segment.y0;
+	int steps = std::max(1, static_cast<int>(std::ceil(std::max(abs(dx), abs(dy)))));
+	float step_x = dx / steps, step_y = dy / steps, step_w = (segment.w1 - segment.w0) / steps;
+
+	float first = 0.0f, last = static_cast<float>(steps);
+	clip_line_steps(segment.x0, step_x, 0.0f, static_cast<float>(framebuffer.width), first, last);
+	clip_line_steps(segment.y0, step_y, static_cast<float>(min_y), static_cast<float>(max_y + 1), first, last);
+	if (first > last)
+		return;
+	// rounding may put the samples at either end just outside, so every sample is still checked against the bounds
+	int k = std::max(0, static_cast<int>(std::floor(first)));
+	int last_k = std::min(steps, static_cast<int>(std::ceil(last)));
+
+	float* depth = framebuffer.depth.data();
+	uint32_t* pixels = framebuffer.color.data();
+	float tolerance = 1.0f + WIREFRAME_DEPTH_TOLERANCE;
+#ifdef __AVX2__
+	const __m256 lane_index = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+	const __m256i width = _mm256_set1_epi32(framebuffer.width);
+	for (; k + 7 <= last_k; k += 8) {
+		__m256 step = _mm256_add_ps(_mm256_set1_ps(static_cast<float>(k)), lane_index);
+		__m256i x = _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_fmadd_ps(step, _mm256_set1_ps(step_x), _mm256_set1_ps(segment.x0))));
+		__m256i y = _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_fmadd_ps(step, _mm256_set1_ps(step_y), _mm256_set1_ps(segment.y0))));
+		__m256 w = _mm256_mul_ps(_mm256_fmadd_ps(step, _mm256_set1_ps(step_w), _mm256_set1_ps(segment.w0)), _mm256_set1_ps(tolerance));
+
+		__m256i inside = _mm256_and_si256(_mm256_cmpgt_epi32(x, _mm256_set1_epi32(-1)), _mm256_cmpgt_epi32(width, x));
+		inside = _mm256_and_si256(inside, _mm256_and_si256(_mm256_cmpgt_epi32(y, _mm256_set1_epi32(min_y - 1)), _mm256_cmpgt_epi32(_mm256_set1_epi32(max_y + 1), y)));
+		__m256i index = _mm256_and_si256(_mm256_add_epi32(_mm256_mullo_epi32(y, width), x), inside);
+		__m256 terrain = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), depth, index, _mm256_castsi256_ps(inside), 4);
+		int pass = _mm256_movemask_ps(_mm256_and_ps(_mm256_castsi256_ps(inside), _mm256_cmp_ps(w, terrain, _CMP_GE_OQ)));
+		if (pass == 0)
+			continue;
+
+		alignas(32) int indices[8];
+		_mm256_store_si256(reinterpret_cast<__m256i*>(indices), index);
+		for (; pass != 0; pass &= pass - 1)
+			pixels[indices[__builtin_ctz(pass)]] = color;
+	}
+#endif
+	for (; k <= last_k; k++) {
+		int x = static_cast<int>(std::floor(segment.x0 + k * step_x));
+		int y = static_cast<int>(std::floor(segment.y0 + k * step_y));
+		if (x < 0 || x >= framebuffer.width || y < min_y || y > max_y)
+			continue;
+		int index = y * framebuffer.width + x;
+		if ((segment.w0 + k * step_w) * tolerance >= depth[index])
+			pixels[index] = color;
+	}
+}
 
-float perspective_factor = camera_position.norm();
+// Hidden line wireframe: the terrain is first rasterized into the depth buffer only, then every grid edge is drawn
+// with the pixels behind the terrain left out. The edges are clipped and projected once, then every thread draws all of
+// them into its own band of rows, so no pixel is written by two threads.
+void rasterize_wireframe(t_thread_pool& pool, const t_view& view, t_frame& frame, t_wireframe& wireframe) {
+	t_framebuffer& framebuffer = frame.framebuffer;
+	rasterize_frame(pool, view, frame, framebuffer, true);
 
-// sunlight simulation
-Eigen::Vector3f light_direction(0.0f, 0.0f, -1.0f); // pointing straight down
+	int rows = wireframe.rows, columns = wireframe.columns;
+	wireframe.view_points.resize(wireframe.points.size());
+	parallel_for(pool, static_cast<int>(wireframe.points.size()), [&](int begin, int end) {
+		for (int k = begin; k < end; k++)
+			wireframe.view_points[k] = terrain_to_view_space(view, wireframe.points[k]);
+	});
 
-void compute_color(t_vertex3d& v) {
-	int val = abs(v.normal.dot(light_direction)) * 255;
-	
-	SDL_Color color{ val , val , val , 0xFF };
-	v.color = color;
+	// the edges along the rows come first, then those along the columns
+	int row_edges = rows * (columns - 1);
+	wireframe.segments.resize(row_edges + columns * (rows - 1));
+	parallel_for(pool, static_cast<int>(wireframe.segments.size()), [&](int begin, int end) {
+		for (int e = begin; e < end; e++) {
+			size_t from, to;
+			if (e < row_edges) {
+				from = static_cast<size_t>(e / (columns - 1)) * columns + e % (columns - 1);
+				to = from + 1;
+			} else {
+				from = static_cast<size_t>((e - row_edges) % (rows - 1)) * columns + (e - row_edges) / (rows - 1);
+				to = from + columns;
+			}
+			t_line_segment& segment = wireframe.segments[e];
+			Eigen::Vector3f a = wireframe.view_points[from], b = wireframe.view_points[to];
+			bool a_clipped, b_clipped;
+			segment.w0 = 0.0f;
+			if (!clip_segment(a, b, a_clipped, b_clipped))
+				continue;
+			Eigen::Vector3f pa = view_to_pixel_coordinates(view, a), pb = view_to_pixel_coordinates(view, b);
+			float x0 = pa.x(), y0 = view.viewport_height - pa.y(), w0 = 1.0f / -a.z();
+			float x1 = pb.x(), y1 = view.viewport_height - pb.y(), w1 = 1.0f / -b.z();
+
+			// cut to the viewport so the DDA never walks off screen, 1 / w is linear in screen space
+			float first = 0.0f, last = 1.0f;
+			clip_line_steps(x0, x1 - x0, -1.0f, view.viewport_width + 1.0f, first, last);
+			clip_line_steps(y0, y1 - y0, -1.0f, view.viewport_height + 1.0f, first, last);
+			if (first > last)
+				continue;
+			segment = t_line_segment{ x0 + first * (x1 - x0), y0 + first * (y1 - y0), w0 + first * (w1 - w0),
+				x0 + last * (x1 - x0), y0 + last * (y1 - y0), w0 + last * (w1 - w0) };
+		}
+	});
+
+	// the same colors as white lines blended over the red background of the SDL wireframe
+	uint32_t background = pack_color(0x5F, 0x00, 0x00), line = pack_color(0xCC, 0xAF, 0xAF);
+	int band_count = (framebuffer.height + TILE_SIZE - 1) / TILE_SIZE;
+	parallel_for(pool, band_count, [&](int begin, int end) {
+		for (int band = begin; band < end; band++) {
+			int min_y = band * TILE_SIZE, max_y = std::min(min_y + TILE_SIZE, framebuffer.height) - 1;
+			std::fill(&framebuffer.color[min_y * framebuffer.width], &framebuffer.color[(max_y + 1) * framebuffer.width], background);
+			for (const t_line_segment& segment : wireframe.segments) {
+				if (segment.w0 > 0.0f && std::max(segment.y0, segment.y1) >= min_y && std::min(segment.y0, segment.y1) < max_y + 1)
+					rasterize_segment(framebuffer, min_y, max_y, segment, line);
+			}
+		}
+	}, 1);
 }
 
-void set_heightmap_normal(int** heightmap, int i, int j, int width, int height, Eigen::Vector3f &normal) {
-	int num_normals = 0;
-	normal.x() = normal.y() = normal.z() = 0;
-	// normal of line above
-	float delta_vertical { 0.0f };
-	float delta_horizontal { 0.0f };
-	float current = heightmap[i][j] / 255.0f;
-	
-	if (i - 1 >= 0) // up
-		delta_vertical += current - heightmap[i - 1][j] / 255.0f;
-	if (i + 1 < height) // down
-		delta_vertical += heightmap[i + 1][j] / 255.0f - current;
-	if (j - 1 >= 0) // left
-		delta_horizontal += heightmap[i][j - 1] / 255.0f - current;
-	if (i + 1 < width) // right
-		delta_horizontal += current - heightmap[i][j + 1] / 255.0f;
+// Renders the heightmap at the given offscreen size with 1 up to all hardware threads and prints the raster time
+void benchmark_raster(const t_mesh& mesh, int width, int height) {
+	t_view view;
+	build_view(view, width, height);
+	t_frame frame;
+	project_triangles(mesh, view, frame);
 
-	// create tangent space vectors so we can compute normal of vertex
-	// note that each vertex corresponds to one pixel in the given heightmap
-	Eigen::Vector3f tangent_vertical(2.0f / height, 0.0f, delta_vertical);
-	Eigen::Vector3f tangent_horizontal(0.0f, 2.0f / width, delta_horizontal);
-	normal = tangent_vertical.cross(tangent_horizontal);
-	normal.normalize();
+	std::vector<uint32_t> reference;
+	double single_thread_time = 0.0;
+	int max_threads = std::max(1u, std::thread::hardware_concurrency());
+
+	printf("rasterizing %d triangles at %dx%d\n", static_cast<int>(frame.visible_triangles.size()), width, height);
+	for (int threads = 1; threads <= max_threads; threads++) {
+		t_thread_pool pool;
+		thread_pool_start(pool, threads);
+		double best_time = INFINITY;
+		for (int run = 0; run < 5; run++) {
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			rasterize_frame(pool, view, frame, frame.framebuffer);
+			std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+			best_time = std::min(best_time, elapsed.count());
+		}
+		thread_pool_stop(pool);
+
+		if (threads == 1) {
+			reference = frame.framebuffer.color;
+			single_thread_time = best_time;
+		}
+		printf("threads %2d: %8.3f ms, speedup %5.2fx%s\n", threads, best_time, single_thread_time / best_time,
+			frame.framebuffer.color == reference ? "" : ", IMAGE DIFFERS FROM 1 THREAD");
+	}
 }
 
-void initialize_vertex(int i, int j, int** heightmap, int width, int height, t_vertex3d& vertex) {
-	float z_fact = 0.2f; // TODO paramatrize this
-	Eigen::Vector3f pos(i, j, z_fact * heightmap[i][j] / 255.0f);
-	
-	vertex.position << pos;
-	vertex.position.x() = vertex.position.x() / height - 0.5f; // the substraction centers the heightmap plane on the x and y -axes
-	vertex.position.y() = vertex.position.y() / width - 0.5f;
-	
-	set_heightmap_normal(heightmap, i, j, width, height, vertex.normal);
-	compute_color(vertex);
+// copies the framebuffer into a streaming texture and draws that over the whole window
+void present_framebuffer(SDL_Renderer* renderer, const t_framebuffer& framebuffer, SDL_Texture*& texture) {
+	if (texture == NULL)
+		texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, framebuffer.width, framebuffer.height);
+
+	void* pixels;
+	int pitch;
+	if (texture == NULL || SDL_LockTexture(texture, NULL, &pixels, &pitch) != 0) {
+		printf("Could not upload the software framebuffer! SDL_Error: %s\n", SDL_GetError());
+		return;
+	}
+	for (int y = 0; y < framebuffer.height; y++)
+		memcpy(static_cast<uint8_t*>(pixels) + y * pitch, &framebuffer.color[y * framebuffer.width], framebuffer.width * sizeof(uint32_t));
+	SDL_UnlockTexture(texture);
+
+	SDL_RenderCopy(renderer, texture, NULL, NULL);
 }
 
-// creates a strip of triangles
-void tris_from_heightmap(int** heightmap, int width, int height, std::vector<t_vertex3d>& triangle_points) {
-	for (int i = 1; i < height; i++)
-	{
-		for (int j = 1; j < width; j++)
-		{			
-			t_vertex3d v[4]; // four points corresponding to the quad of the heightmap we are currently processing
+// Mip pyramid of the heightmap for the voxel space renderer, level k averages 2^k x 2^k samples. Heights are kept as
+// 16 bit fractions of the maximum so that the averages stay smooth and a large map still fits in memory.
+typedef struct s_height_pyramid {
+	std::vector<std::vector<uint16_t>> levels; // row major
+	std::vector<int> rows, columns; // per level
+	Eigen::Vector2f grid_origin; // world x/y of sample (0, 0), same as the mesh
+	Eigen::Vector2f cell_size; // world x/y distance between level 0 samples
+	float height_scale; // world z of one unit
+} t_height_pyramid;
 
-			initialize_vertex(i - 1, j - 1, heightmap, width, height, v[0]);
-			initialize_vertex(i - 1, j, heightmap, width, height, v[1]);
-			initialize_vertex(i, j - 1, heightmap, width, height, v[2]);
-			initialize_vertex(i, j, heightmap, width, height, v[3]);
+void build_height_pyramid(int** heightmap, int width, int height, t_height_pyramid& pyramid) {
+	pyramid.levels.assign(1, std::vector<uint16_t>(static_cast<size_t>(width) * height));
+	pyramid.rows.assign(1, height);
+	pyramid.columns.assign(1, width);
+	pyramid.grid_origin = Eigen::Vector2f(-0.5f, -0.5f); // matches initialize_vertex
+	pyramid.cell_size = Eigen::Vector2f(1.0f / height, 1.0f / width);
+	pyramid.height_scale = HEIGHT_SCALE / 257.0f; // over the 0..255 * 257 range below
 
-			// triangle 1
-			triangle_points.push_back(v[0]);
-			triangle_points.push_back(v[1]);
-			triangle_points.push_back(v[2]);
+	for (int i = 0; i < height; i++) {
+		for (int j = 0; j < width; j++)
+			pyramid.levels[0][static_cast<size_t>(i) * width + j] = static_cast<uint16_t>(heightmap[i][j] * 257);
+	}
 
-			// triangle 2
-			triangle_points.push_back(v[1]);
-			triangle_points.push_back(v[2]);
-			triangle_points.push_back(v[3]);
+	while (pyramid.rows.back() > 1 || pyramid.columns.back() > 1) {
+		const std::vector<uint16_t>& fine = pyramid.levels.back();
+		int fine_rows = pyramid.rows.back(), fine_columns = pyramid.columns.back();
+		int rows = (fine_rows + 1) / 2, columns = (fine_columns + 1) / 2;
+		std::vector<uint16_t> coarse(static_cast<size_t>(rows) * columns);
+		for (int i = 0; i < rows; i++) {
+			for (int j = 0; j < columns; j++) {
+				// odd sizes repeat the last row or column
+				int i1 = std::min(2 * i + 1, fine_rows - 1), j1 = std::min(2 * j + 1, fine_columns - 1);
+				uint32_t sum = fine[static_cast<size_t>(2 * i) * fine_columns + 2 * j] + fine[static_cast<size_t>(2 * i) * fine_columns + j1]
+					+ fine[static_cast<size_t>(i1) * fine_columns + 2 * j] + fine[static_cast<size_t>(i1) * fine_columns + j1];
+				coarse[static_cast<size_t>(i) * columns + j] = static_cast<uint16_t>((sum + 2) / 4);
+			}
 		}
+		pyramid.levels.push_back(std::move(coarse));
+		pyramid.rows.push_back(rows);
+		pyramid.columns.push_back(columns);
 	}
 }
 
-void to_pixel_coordinates_verticies(std::vector<t_vertex3d>& verticies) {
-	Eigen::Vector3f focus_point(0.0f, 0.0f, 0.0f);
-	Eigen::Vector3f camera_look_at = camera_position - focus_point;
-	camera_look_at.normalize();
+inline float pyramid_height(const t_height_pyramid& pyramid, int level, int i, int j) {
+	i = std::clamp(i, 0, pyramid.rows[level] - 1);
+	j = std::clamp(j, 0, pyramid.columns[level] - 1);
+	return pyramid.levels[level][static_cast<size_t>(i) * pyramid.columns[level] + j] * pyramid.height_scale;
+}
 
-	Eigen::Vector3f camera_up(0.0f, 0.0f, 1.0f);
+// screen pixels one voxel space sample may stretch over, larger is faster and blurrier
+const float VOXEL_SAMPLE_PIXELS = 1.0f;
 
-	Eigen::Vector3f camera_right = camera_up.cross(camera_look_at);
-	camera_right.normalize();
+// Comanche style renderer. Every screen column marches front to back along the line where its plane of view rays
+// meets the mean terrain height, so samples near that height land in their own column. Each sample is projected with
+// the camera like a mesh vertex and fills the column from the last filled row up to its own row (the "y-buffer"), so
+// anything behind terrain that already reached higher up the screen is skipped. The step grows with distance
+// so that a sample covers about a pixel, and the pyramid level is picked to match the step, which keeps the cost at
+// screen width times log(view distance) no matter how large the heightmap is. Columns are split across the threads.
+// Assumes the camera is above the terrain; depth (1 / w) is written like the software rasterizer does.
+void render_voxel_space(t_thread_pool& pool, const t_view& view, const t_height_pyramid& pyramid, t_framebuffer& framebuffer) {
+	int width = view.viewport_width, height = view.viewport_height;
+	framebuffer.width = width;
+	framebuffer.height = height;
+	framebuffer.color.assign(static_cast<size_t>(width) * height, pack_color(0xC0, 0xC0, 0xC0));
+	framebuffer.depth.assign(static_cast<size_t>(width) * height, 0.0f);
 
-	camera_up = camera_look_at.cross(camera_right);
-	camera_up.normalize();
+	Eigen::Vector3f right = view.view_matrix.row(0).transpose();
+	Eigen::Vector3f up = view.view_matrix.row(1).transpose();
+	Eigen::Vector3f look_at = view.view_matrix.row(2).transpose(); // points back at the camera
+	Eigen::Vector2f forward = -look_at.head<2>();
+	if (forward.norm() < 1e-6f)
+		return; // looking straight down, there are no columns to march along
+	forward.normalize();
+	Eigen::Vector2f side = right.head<2>().normalized(); // right is horizontal, the camera has no roll
 
-	Eigen::Matrix3f view_matrix;
-	// these lines build the matrix that transforms from view coords to world coords
-	view_matrix.col(0) << camera_right;
-	view_matrix.col(1) << camera_up;
-	view_matrix.col(2) << camera_look_at;
+	// a point d ahead, l to the side and dz above the camera has view depth d * forward_depth + dz * up_depth and
+	// view y d * forward_y + dz * up_y
+	float forward_depth = -Eigen::Vector3f(forward.x(), forward.y(), 0.0f).dot(look_at), up_depth = -look_at.z();
+	float forward_y = Eigen::Vector3f(forward.x(), forward.y(), 0.0f).dot(up), up_y = up.z();
+	float focal_length = view.perspective_factor * view.zoom_factor;
 
-	// we take the transpose of it to take its inverse
-	view_matrix.transposeInPlace();
+	float exaggeration = view.exaggeration;
+	float mean_height = pyramid_height(pyramid, static_cast<int>(pyramid.levels.size()) - 1, 0, 0) * exaggeration;
+	float camera_height = view.camera_position.z();
+	Eigen::Vector2f camera_ground = view.camera_position.head<2>();
+	Eigen::Vector2f grid_min = pyramid.grid_origin;
+	Eigen::Vector2f grid_max = pyramid.grid_origin + pyramid.cell_size.cwiseProduct(Eigen::Vector2f(pyramid.rows[0] - 1, pyramid.columns[0] - 1));
+	float finest_step = std::min(pyramid.cell_size.x(), pyramid.cell_size.y());
+	int top_level = static_cast<int>(pyramid.levels.size()) - 1;
+	float unscale = 1.0f / (pyramid.height_scale * 65535.0f); // world z back to 0..1
+
+	parallel_for(pool, width, [&](int begin, int end) {
+		for (int column = begin; column < end; column++) {
+			// the column's line at the mean height: ground(d) = start + d * direction, d being the distance ahead
+			float slope = (column + 0.5f - width / 2.0f) / focal_length;
+			Eigen::Vector2f start = camera_ground + side * (slope * (mean_height - camera_height) * up_depth);
+			Eigen::Vector2f direction = forward + side * (slope * forward_depth);
+
+			// the part of the line over the grid
+			float enter = NEAR_PLANE, leave = FAR_PLANE;
+			for (int axis = 0; axis < 2; axis++) {
+				if (abs(direction[axis]) < 1e-9f) {
+					if (start[axis] < grid_min[axis] || start[axis] > grid_max[axis])
+						leave = -1.0f;
+					continue;
+				}
+				float t0 = (grid_min[axis] - start[axis]) / direction[axis];
+				float t1 = (grid_max[axis] - start[axis]) / direction[axis];
+				enter = std::max(enter, std::min(t0, t1));
+				leave = std::min(leave, std::max(t0, t1));
+			}
 
-	// TODO this can be just one matrix multiplication, right?
-	Eigen::Vector3f translation;
-	translation.x() = camera_position.dot(camera_right);
-	translation.y() = camera_position.dot(camera_up);
-	translation.z() = camera_position.dot(camera_look_at);
+			int filled = -1; // this row and the ones below it are done, -1 until the first sample sets where the terrain starts
+			float direction_length = direction.norm();
+			for (float d = enter; d <= leave && filled != 0;) {
+				// a sample should cover about VOXEL_SAMPLE_PIXELS, the level is the coarsest whose cells are not larger
+				float step = std::max(finest_step, d * VOXEL_SAMPLE_PIXELS / focal_length * direction_length);
+				int level = std::min(top_level, static_cast<int>(std::log2(step / finest_step)));
+				int scale = 1 << level;
+
+				Eigen::Vector2f ground = start + direction * d;
+				int i = static_cast<int>((ground.x() - grid_min.x()) / pyramid.cell_size.x() + 0.5f) / scale;
+				int j = static_cast<int>((ground.y() - grid_min.y()) / pyramid.cell_size.y() + 0.5f) / scale;
+				float z = pyramid_height(pyramid, level, i, j) * exaggeration;
+				float depth = d * forward_depth + (z - camera_height) * up_depth;
+				float view_y = d * forward_y + (z - camera_height) * up_y;
+				d += step / direction_length;
+				if (depth < NEAR_PLANE)
+					continue;
+
+				// the first row whose center lies below the sample, screen y points down
+				float y = height / 2.0f - focal_length * view_y / depth;
+				int row = std::clamp(static_cast<int>(std::ceil(y - 0.5f)), 0, height);
+				if (filled < 0) {
+					filled = row;
+					continue;
+				}
+				if (row >= filled)
+					continue; // hidden behind what the column already shows
+
+				// shade from the slope of this level, measured on 0..1 heights like set_heightmap_normal does
+				float slope_x = (pyramid_height(pyramid, level, i + 1, j) - pyramid_height(pyramid, level, i - 1, j)) * unscale / (2.0f * pyramid.cell_size.x() * scale);
+				float slope_y = (pyramid_height(pyramid, level, i, j + 1) - pyramid_height(pyramid, level, i, j - 1)) * unscale / (2.0f * pyramid.cell_size.y() * scale);
+				Eigen::Vector3f normal(-slope_x, -slope_y, 1.0f);
+				SDL_Color color = shade(exaggerate_normal(normal, exaggeration));
+				uint32_t packed = pack_color(color.r, color.g, color.b);
+				float inverse_depth = 1.0f / depth;
+				while (filled > row) {
+					filled--;
+					framebuffer.color[static_cast<size_t>(filled) * width + column] = packed;
+					framebuffer.depth[static_cast<size_t>(filled) * width + column] = inverse_depth;
+				}
+			}
+		}
+	}, 16);
+}
 
-	// TODO: if we do not modify the vertices but instead pass the matrix on, we could get rid of this expensive copy
-	for (t_vertex3d& v : verticies) {
-		v.position -= camera_position;
-		v.position = view_matrix * v.position;
+// Maximum mipmap of the mesh surface for the ray tracer. Level 0 holds the highest and lowest corner of every quad,
+// level k the extremes over 2^k x 2^k quads, up to a single node for the whole grid. All levels share one array, level
+// k starting at level_offsets[k], so the rays of a packet can gather their nodes on different levels at once.
+typedef struct s_height_quadtree {
+	std::vector<float> max_heights, min_heights; // row major within a level
+	std::vector<int> level_offsets;
+	std::vector<int> rows, columns; // nodes per level, level 0 has one per quad
+	std::vector<float> heights; // world z of every heightmap sample, row major
+	std::vector<Eigen::Vector3f> normals; // per sample, the same the mesh verticies get
+	int sample_columns;
+	Eigen::Vector2f grid_origin; // world x/y of sample (0, 0), same as the mesh
+	Eigen::Vector2f cell_size; // world x/y size of one quad
+} t_height_quadtree;
 
-		// perspective division
-		v.position.x() *= perspective_factor / abs(v.position.z());
-		v.position.y() *= perspective_factor / abs(v.position.z());
-		// !!! NOTE that we do not divide the z-coordinate since we need to perserve it for visible surface detection
+void build_height_quadtree(int** heightmap, int width, int height, t_height_quadtree& tree) {
+	tree.sample_columns = width;
+	tree.grid_origin = Eigen::Vector2f(-0.5f, -0.5f); // matches initialize_vertex
+	tree.cell_size = Eigen::Vector2f(1.0f / height, 1.0f / width);
+	tree.heights.resize(static_cast<size_t>(width) * height);
+	tree.normals.resize(static_cast<size_t>(width) * height);
+	for (int i = 0; i < height; i++) {
+		for (int j = 0; j < width; j++) {
+			t_vertex3d vertex;
+			initialize_vertex(i, j, heightmap, width, height, vertex);
+			tree.heights[static_cast<size_t>(i) * width + j] = vertex.position.z();
+			tree.normals[static_cast<size_t>(i) * width + j] = vertex.normal;
+		}
+	}
 
-		float zoom_factor = 500.0f;
-		v.position *= zoom_factor;
+	int rows = std::max(1, height - 1), columns = std::max(1, width - 1);
+	tree.max_heights.resize(static_cast<size_t>(rows) * columns);
+	tree.min_heights.resize(static_cast<size_t>(rows) * columns);
+	tree.level_offsets.assign(1, 0);
+	tree.rows.assign(1, rows);
+	tree.columns.assign(1, columns);
+	for (int i = 0; i < rows; i++) {
+		for (int j = 0; j < columns; j++) {
+			int i1 = std::min(i + 1, height - 1), j1 = std::min(j + 1, width - 1);
+			float corners[4] = { tree.heights[static_cast<size_t>(i) * width + j], tree.heights[static_cast<size_t>(i) * width + j1],
+				tree.heights[static_cast<size_t>(i1) * width + j], tree.heights[static_cast<size_t>(i1) * width + j1] };
+			tree.max_heights[static_cast<size_t>(i) * columns + j] = *std::max_element(corners, corners + 4);
+			tree.min_heights[static_cast<size_t>(i) * columns + j] = *std::min_element(corners, corners + 4);
+		}
+	}
 
-		// transform to pixel coordinates
-		v.position.x() += SCREEN_WIDTH / 2.0f;
-		v.position.y() += SCREEN_HEIGHT / 2.0f;
+	while (tree.rows.back() > 1 || tree.columns.back() > 1) {
+		int fine_rows = tree.rows.back(), fine_columns = tree.columns.back();
+		size_t fine_offset = tree.level_offsets.back(), offset = tree.max_heights.size();
+		rows = (fine_rows + 1) / 2;
+		columns = (fine_columns + 1) / 2;
+		tree.max_heights.resize(offset + static_cast<size_t>(rows) * columns);
+		tree.min_heights.resize(offset + static_cast<size_t>(rows) * columns);
+		for (int i = 0; i < rows; i++) {
+			for (int j = 0; j < columns; j++) {
+				int i1 = std::min(2 * i + 1, fine_rows - 1), j1 = std::min(2 * j + 1, fine_columns - 1);
+				size_t children[4] = { fine_offset + static_cast<size_t>(2 * i) * fine_columns + 2 * j, fine_offset + static_cast<size_t>(2 * i) * fine_columns + j1,
+					fine_offset + static_cast<size_t>(i1) * fine_columns + 2 * j, fine_offset + static_cast<size_t>(i1) * fine_columns + j1 };
+				const std::vector<float>& max_heights = tree.max_heights;
+				const std::vector<float>& min_heights = tree.min_heights;
+				tree.max_heights[offset + static_cast<size_t>(i) * columns + j] = std::max({ max_heights[children[0]], max_heights[children[1]], max_heights[children[2]], max_heights[children[3]] });
+				tree.min_heights[offset + static_cast<size_t>(i) * columns + j] = std::min({ min_heights[children[0]], min_heights[children[1]], min_heights[children[2]], min_heights[children[3]] });
+			}
+		}
+		tree.level_offsets.push_back(static_cast<int>(offset));
+		tree.rows.push_back(rows);
+		tree.columns.push_back(columns);
 	}
 }
 
-void to_pixel_coordinates_lines(std::vector<Line3f> &lines) {	
-	Eigen::Vector3f focus_point(0.0f, 0.0f, 0.0f);
-	Eigen::Vector3f camera_look_at = camera_position - focus_point;
-	camera_look_at.normalize();
-	
-	Eigen::Vector3f camera_up(0.0f, 0.0f, 1.0f);
-	
-	Eigen::Vector3f camera_right = camera_up.cross(camera_look_at);
-	camera_right.normalize();
-	
-	camera_up = camera_look_at.cross(camera_right);
-	camera_up.normalize();
+// a ray in grid space: x and y count quads (sample (i, j) sits at (i, j)), z is world height before the exaggeration,
+// t is shared with world space
+typedef struct s_grid_ray {
+	Eigen::Vector3f origin, direction;
+} t_grid_ray;
 
-	Eigen::Matrix3f view_matrix;
-	// these lines build the matrix that transforms from view coords to world coords
-	view_matrix.col(0) << camera_right;
-	view_matrix.col(1) << camera_up;
-	view_matrix.col(2) << camera_look_at;
+inline t_grid_ray to_grid_ray(const t_height_quadtree& tree, float exaggeration, const Eigen::Vector3f& origin, const Eigen::Vector3f& direction) {
+	t_grid_ray ray;
+	ray.origin = Eigen::Vector3f((origin.x() - tree.grid_origin.x()) / tree.cell_size.x(), (origin.y() - tree.grid_origin.y()) / tree.cell_size.y(), origin.z() / exaggeration);
+	ray.direction = Eigen::Vector3f(direction.x() / tree.cell_size.x(), direction.y() / tree.cell_size.y(), direction.z() / exaggeration);
+	return ray;
+}
 
-	// we take the transpose of it to take its inverse
-	view_matrix.transposeInPlace();
+// the first t in [t_begin, t_end] at which the ray passes down through one of the two triangles of quad (row, column),
+// or INFINITY; the triangles are split along the same diagonal as in tris_from_heightmap
+inline float intersect_quad(const t_height_quadtree& tree, const t_grid_ray& ray, int row, int column, float t_begin, float t_end) {
+	const float* sample = &tree.heights[static_cast<size_t>(row) * tree.sample_columns + column];
+	float h0 = sample[0], h1 = sample[1], h2 = sample[tree.sample_columns], h3 = sample[tree.sample_columns + 1];
+	// quad local a (along rows) and b (along columns), both 0..1 inside the quad
+	float a0 = ray.origin.x() - row, b0 = ray.origin.y() - column;
+	// z = base + slope_a * a + slope_b * b, the first triangle covers a + b <= 1, the second a + b >= 1
+	float planes[2][3] = { { h0, h2 - h0, h1 - h0 }, { h1 + h2 - h3, h3 - h1, h3 - h2 } };
+	const float margin = 1e-4f;
 
-	Eigen::Vector3f translation;
-	translation.x() = camera_position.dot(camera_right);
-	translation.y() = camera_position.dot(camera_up);
-	translation.z() = camera_position.dot(camera_look_at);
-	
-	for (Line3f& line : lines) {
-		line.col(0) -= camera_position;
-		line.col(1) -= camera_position;
-		line = view_matrix * line;
-		
-		// perspective division
-		// if (line.col(0).z() < -1)
-			line.col(0) *= perspective_factor / abs(line.col(0).z());
-		// if (line.col(1).z() < -1)
-			line.col(1) *= perspective_factor / abs(line.col(1).z());
+	float hit = INFINITY;
+	for (int k = 0; k < 2; k++) {
+		// the ray's height above the plane is linear in t
+		float above = ray.origin.z() - (planes[k][0] + planes[k][1] * a0 + planes[k][2] * b0);
+		float rate = ray.direction.z() - (planes[k][1] * ray.direction.x() + planes[k][2] * ray.direction.y());
+		if (rate >= 0.0f)
+			continue; // parallel, or coming from below, and the terrain has no underside
 
-		float zoom_factor = 500.0f;
-		line *= zoom_factor;
+		float t = -above / rate;
+		if (t < t_begin - margin || t > t_end + margin || t >= hit)
+			continue;
+		float a = a0 + ray.direction.x() * t, b = b0 + ray.direction.y() * t;
+		bool inside = a >= -margin && b >= -margin && a <= 1.0f + margin && b <= 1.0f + margin
+			&& (k == 0 ? a + b <= 1.0f + margin : a + b >= 1.0f - margin);
+		if (inside)
+			hit = std::max(t, t_begin);
+	}
+	return hit;
+}
 
-		// transform to pixel coordinates here
-		line.col(0).y() += SCREEN_HEIGHT / 2.0f;
-		line.col(1).y() += SCREEN_HEIGHT / 2.0f;
+#ifdef __AVX2__
+// intersect_quad for the 8 rays of a packet, each in its own quad; the rays are in structure of arrays form
+inline __m256 intersect_quad_packet(const t_height_quadtree& tree, const __m256* origin, const __m256* direction, __m256i row, __m256i column, __m256 t_begin, __m256 t_end) {
+	__m256i sample = _mm256_add_epi32(_mm256_mullo_epi32(row, _mm256_set1_epi32(tree.sample_columns)), column);
+	const float* heights = tree.heights.data();
+	__m256 h0 = _mm256_i32gather_ps(heights, sample, 4), h1 = _mm256_i32gather_ps(heights + 1, sample, 4);
+	__m256 h2 = _mm256_i32gather_ps(heights + tree.sample_columns, sample, 4), h3 = _mm256_i32gather_ps(heights + tree.sample_columns + 1, sample, 4);
+	__m256 a0 = _mm256_sub_ps(origin[0], _mm256_cvtepi32_ps(row)), b0 = _mm256_sub_ps(origin[1], _mm256_cvtepi32_ps(column));
+	__m256 planes[2][3] = { { h0, _mm256_sub_ps(h2, h0), _mm256_sub_ps(h1, h0) },
+		{ _mm256_sub_ps(_mm256_add_ps(h1, h2), h3), _mm256_sub_ps(h3, h1), _mm256_sub_ps(h3, h2) } };
+	const __m256 margin = _mm256_set1_ps(1e-4f), one = _mm256_set1_ps(1.0f), negative_margin = _mm256_set1_ps(-1e-4f);
 
-		line.col(0).x() += SCREEN_WIDTH / 2.0f;
-		line.col(1).x() += SCREEN_WIDTH / 2.0f;
+	__m256 hit = _mm256_set1_ps(INFINITY);
+	for (int k = 0; k < 2; k++) {
+		__m256 above = _mm256_sub_ps(origin[2], _mm256_add_ps(_mm256_add_ps(planes[k][0], _mm256_mul_ps(planes[k][1], a0)), _mm256_mul_ps(planes[k][2], b0)));
+		__m256 rate = _mm256_sub_ps(direction[2], _mm256_add_ps(_mm256_mul_ps(planes[k][1], direction[0]), _mm256_mul_ps(planes[k][2], direction[1])));
+		__m256 t = _mm256_div_ps(_mm256_xor_ps(above, _mm256_set1_ps(-0.0f)), rate);
+		__m256 valid = _mm256_and_ps(_mm256_cmp_ps(rate, _mm256_setzero_ps(), _CMP_LT_OQ), _mm256_cmp_ps(t, _mm256_sub_ps(t_begin, margin), _CMP_GE_OQ));
+		valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, _mm256_add_ps(t_end, margin), _CMP_LE_OQ), _mm256_cmp_ps(t, hit, _CMP_LT_OQ)));
+		__m256 a = _mm256_add_ps(a0, _mm256_mul_ps(direction[0], t)), b = _mm256_add_ps(b0, _mm256_mul_ps(direction[1], t));
+		valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(a, negative_margin, _CMP_GE_OQ), _mm256_cmp_ps(b, negative_margin, _CMP_GE_OQ)));
+		valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(a, _mm256_add_ps(one, margin), _CMP_LE_OQ), _mm256_cmp_ps(b, _mm256_add_ps(one, margin), _CMP_LE_OQ)));
+		__m256 diagonal = k == 0 ? _mm256_cmp_ps(_mm256_add_ps(a, b), _mm256_add_ps(one, margin), _CMP_LE_OQ) : _mm256_cmp_ps(_mm256_add_ps(a, b), _mm256_sub_ps(one, margin), _CMP_GE_OQ);
+		hit = _mm256_blendv_ps(hit, _mm256_max_ps(t, t_begin), _mm256_and_ps(valid, diagonal));
 	}
+	return hit;
 }
+#endif
 
-void lines_from_heightmap(int** heightmap, int width, int height, std::vector<Line3f> &lines) {
-	// heightmap will displace a unit rectangle with corners at (-0.5,-0.5,0) and (0.5, 0.5, 0)
-	for (int i = 0; i < height; i++)
-	{
-		for (int j = 0; j < width; j++)
-		{
-			float z_fact = 0.2f;
-			
-			Eigen::Vector3f current(i - (height/2), j - (width/2), z_fact * heightmap[i][j] / 255.0f);
+// Cuts [t_begin, t_end] down to the part of the ray above the grid and below its highest point, the only part that
+// can hit anything. Returns false when nothing is left.
+inline bool clip_to_height_quadtree(const t_height_quadtree& tree, const t_grid_ray& ray, float& t_begin, float& t_end) {
+	float bounds_min[2] = { 0.0f, 0.0f }, bounds_max[2] = { static_cast<float>(tree.rows[0]), static_cast<float>(tree.columns[0]) };
+	for (int axis = 0; axis < 2; axis++) {
+		if (ray.direction[axis] == 0.0f) {
+			if (ray.origin[axis] < bounds_min[axis] || ray.origin[axis] > bounds_max[axis])
+				return false;
+			continue;
+		}
+		float t0 = (bounds_min[axis] - ray.origin[axis]) / ray.direction[axis];
+		float t1 = (bounds_max[axis] - ray.origin[axis]) / ray.direction[axis];
+		t_begin = std::max(t_begin, std::min(t0, t1));
+		t_end = std::min(t_end, std::max(t0, t1));
+	}
+	float highest = tree.max_heights[tree.level_offsets.back()];
+	if (ray.direction.z() < 0.0f)
+		t_begin = std::max(t_begin, (highest - ray.origin.z()) / ray.direction.z());
+	else if (ray.direction.z() > 0.0f)
+		t_end = std::min(t_end, (highest - ray.origin.z()) / ray.direction.z());
+	else if (ray.origin.z() > highest)
+		return false;
+	return t_begin <= t_end;
+}
 
-			// TODO D.R.Y. or copy setup from tris
-			if (i > 0)
-			{
-				Eigen::Vector3f up(i - 1.0f - (height / 2), j - (width / 2), z_fact* heightmap[i - 1][j] / 255.0f);
-				Line3f temp;
-				temp << current, up;
-				temp.row(0) /= height;
-				temp.row(1) /= width;
-				lines.push_back(temp);
-			}
-			if (j > 0)
-			{
-				Eigen::Vector3f left(i - (height / 2), j - 1.0f - (width / 2), z_fact* heightmap[i][j - 1] / 255.0f);
-				Line3f temp;
-				temp << current, left;
-				temp.row(0) /= height;
-				temp.row(1) /= width;
-				lines.push_back(temp);
+// how far along the ray the node at t is looked up, so a ray on a node boundary picks the next node: a small part of a
+// quad, but on large grids that can be less than float resolves at t, so never less than a few ulp of t
+const float PROBE_QUADS = 1e-4f, PROBE_RELATIVE = 1e-6f;
+
+inline float quadtree_probe(const t_grid_ray& ray) {
+	return PROBE_QUADS / std::max({ abs(ray.direction.x()), abs(ray.direction.y()), 1e-6f });
+}
+
+// where a walk down the max mipmap is: at t on level, having just stepped out of node (left_row, left_column) of that
+// level, or -1 when it did not step
+typedef struct s_quadtree_walk {
+	float t;
+	int level, left_row, left_column;
+} t_quadtree_walk;
+
+// Walks the max mipmap along the ray from walk and returns the first hit up to t_end, or INFINITY. A node the ray
+// passes entirely above is skipped in one step and the walk goes up to the largest node it just entered, otherwise it
+// goes down a level, until the quads themselves are intersected. A node the ray passes entirely below is skipped as
+// well, since the terrain has no underside, or with any_hit (for shadow rays) ends the walk. row and column are set to
+// the quad that was hit.
+float walk_height_quadtree(const t_height_quadtree& tree, const t_grid_ray& ray, t_quadtree_walk walk, float t_end, bool any_hit, int& row, int& column) {
+	int top_level = static_cast<int>(tree.level_offsets.size()) - 1;
+	int quad_rows = tree.rows[0], quad_columns = tree.columns[0];
+	float quad_probe = quadtree_probe(ray);
+	int& level = walk.level;
+	int& left_row = walk.left_row;
+	int& left_column = walk.left_column;
+	float& t = walk.t;
+	while (t <= t_end) {
+		float probe = std::max(quad_probe, abs(t) * PROBE_RELATIVE);
+		float probe_t = std::min(t + probe, t_end);
+		int quad_row = std::clamp(static_cast<int>(std::floor(ray.origin.x() + ray.direction.x() * probe_t)), 0, quad_rows - 1);
+		int quad_column = std::clamp(static_cast<int>(std::floor(ray.origin.y() + ray.direction.y() * probe_t)), 0, quad_columns - 1);
+		// after a step, go up as long as the step also left the parent; a sibling inside the same parent has to be
+		// looked at on this level anyway, since the parent could not be skipped
+		while (left_row >= 0 && level < top_level && ((quad_row >> (level + 1)) != (left_row >> 1) || (quad_column >> (level + 1)) != (left_column >> 1))) {
+			level++;
+			left_row >>= 1;
+			left_column >>= 1;
+		}
+		left_row = -1;
+		int node_row = quad_row >> level, node_column = quad_column >> level;
+
+		// where the ray leaves the node
+		float t_exit = t_end;
+		float node_min[2] = { static_cast<float>(node_row << level), static_cast<float>(node_column << level) };
+		float node_max[2] = { static_cast<float>(std::min((node_row + 1) << level, quad_rows)), static_cast<float>(std::min((node_column + 1) << level, quad_columns)) };
+		for (int axis = 0; axis < 2; axis++) {
+			if (ray.direction[axis] > 0.0f)
+				t_exit = std::min(t_exit, (node_max[axis] - ray.origin[axis]) / ray.direction[axis]);
+			else if (ray.direction[axis] < 0.0f)
+				t_exit = std::min(t_exit, (node_min[axis] - ray.origin[axis]) / ray.direction[axis]);
+		}
+		t_exit = std::max(t_exit, t + probe); // always make progress
+
+		size_t node = tree.level_offsets[level] + static_cast<size_t>(node_row) * tree.columns[level] + node_column;
+		float z_enter = ray.origin.z() + ray.direction.z() * t, z_exit = ray.origin.z() + ray.direction.z() * t_exit;
+		if (std::min(z_enter, z_exit) > tree.max_heights[node]) {
+			t = t_exit;
+			left_row = node_row;
+			left_column = node_column;
+			continue;
+		}
+		if (std::max(z_enter, z_exit) < tree.min_heights[node]) {
+			if (any_hit) {
+				row = quad_row;
+				column = quad_column;
+				return t;
 			}
+			// under the surface, where a ray that entered through the side of the grid stays until it leaves it
+			t = t_exit;
+			left_row = node_row;
+			left_column = node_column;
+			continue;
+		}
+		if (level > 0) {
+			level--;
+			continue;
+		}
+
+		float hit = intersect_quad(tree, ray, quad_row, quad_column, t, t_exit);
+		if (hit < INFINITY) {
+			row = quad_row;
+			column = quad_column;
+			return hit;
+		}
+		t = t_exit;
+		left_row = node_row;
+		left_column = node_column;
+	}
+	return INFINITY;
+}
+
+// the first hit of the ray in [t_begin, t_end], or INFINITY, see walk_height_quadtree
+float trace_height_quadtree(const t_height_quadtree& tree, const t_grid_ray& ray, float t_begin, float t_end, bool any_hit, int& row, int& column) {
+	if (!clip_to_height_quadtree(tree, ray, t_begin, t_end))
+		return INFINITY;
+	t_quadtree_walk walk = { t_begin, static_cast<int>(tree.level_offsets.size()) - 1, -1, -1 };
+	return walk_height_quadtree(tree, ray, walk, t_end, any_hit, row, column);
+}
 
+#ifdef __AVX2__
+// below this many rays a packet is no faster than its rays one by one
+const int PACKET_MIN_RAYS = 3;
+
+// trace_height_quadtree for the 8 rays of a packet, the lanes set in active. Every iteration moves each ray one step of
+// its own walk, up, across or down a node or into the quads, with the nodes of all the rays gathered at once. Rays of
+// neighbouring pixels take about the same steps, so the lanes stay busy until the rays diverge near the surface; once
+// fewer than PACKET_MIN_RAYS are left the scalar walk finishes them. hits of the other lanes are INFINITY, hits has
+// to be 32 byte aligned.
+void trace_height_quadtree_packet(const t_height_quadtree& tree, const t_grid_ray* rays, int active, float t_begin, float t_end, bool any_hit, float* hits, int* rows, int* columns) {
+	int top_level = static_cast<int>(tree.level_offsets.size()) - 1;
+	alignas(32) float lane_origin[3][8], lane_direction[3][8], lane_probe[8], lane_t[8], lane_end[8];
+	for (int lane = 0; lane < 8; lane++) {
+		hits[lane] = INFINITY;
+		float begin = t_begin, end = t_end;
+		if (!(active >> lane & 1) || !clip_to_height_quadtree(tree, rays[lane], begin, end)) {
+			active &= ~(1 << lane);
+			begin = end = 0.0f;
+		}
+		for (int axis = 0; axis < 3; axis++) {
+			lane_origin[axis][lane] = rays[lane].origin[axis];
+			lane_direction[axis][lane] = rays[lane].direction[axis];
+		}
+		lane_probe[lane] = quadtree_probe(rays[lane]);
+		lane_t[lane] = begin;
+		lane_end[lane] = end;
+	}
+
+	__m256 origin[3], direction[3];
+	for (int axis = 0; axis < 3; axis++) {
+		origin[axis] = _mm256_load_ps(lane_origin[axis]);
+		direction[axis] = _mm256_load_ps(lane_direction[axis]);
+	}
+	__m256 quad_probe = _mm256_load_ps(lane_probe), t = _mm256_load_ps(lane_t), end = _mm256_load_ps(lane_end);
+	__m256 hit = _mm256_set1_ps(INFINITY);
+	const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi32(1), none = _mm256_set1_epi32(-1);
+	const __m256i top = _mm256_set1_epi32(top_level), last_row = _mm256_set1_epi32(tree.rows[0] - 1), last_column = _mm256_set1_epi32(tree.columns[0] - 1);
+	__m256i lanes = _mm256_cmpgt_epi32(_mm256_and_si256(_mm256_set1_epi32(active), _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128)), zero);
+	__m256i level = top, left_row = none, left_column = none, hit_row = zero, hit_column = zero;
+
+	while (true) {
+		lanes = _mm256_and_si256(lanes, _mm256_castps_si256(_mm256_cmp_ps(t, end, _CMP_LE_OQ)));
+		if (__builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(lanes))) < PACKET_MIN_RAYS)
+			break;
+
+		__m256 probe = _mm256_max_ps(quad_probe, _mm256_mul_ps(_mm256_andnot_ps(_mm256_set1_ps(-0.0f), t), _mm256_set1_ps(PROBE_RELATIVE)));
+		__m256 probe_t = _mm256_min_ps(_mm256_add_ps(t, probe), end);
+		__m256i quad_row = _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_add_ps(origin[0], _mm256_mul_ps(direction[0], probe_t))));
+		__m256i quad_column = _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_add_ps(origin[1], _mm256_mul_ps(direction[1], probe_t))));
+		quad_row = _mm256_min_epi32(_mm256_max_epi32(quad_row, zero), last_row);
+		quad_column = _mm256_min_epi32(_mm256_max_epi32(quad_column, zero), last_column);
+		while (true) {
+			__m256i parent = _mm256_add_epi32(level, one);
+			__m256i left_parent = _mm256_or_si256(
+				_mm256_xor_si256(_mm256_cmpeq_epi32(_mm256_srav_epi32(quad_row, parent), _mm256_srai_epi32(left_row, 1)), none),
+				_mm256_xor_si256(_mm256_cmpeq_epi32(_mm256_srav_epi32(quad_column, parent), _mm256_srai_epi32(left_column, 1)), none));
+			__m256i up = _mm256_and_si256(_mm256_and_si256(lanes, left_parent), _mm256_andnot_si256(_mm256_cmpgt_epi32(zero, left_row), _mm256_cmpgt_epi32(top, level)));
+			if (_mm256_testz_si256(up, up))
+				break;
+			level = _mm256_sub_epi32(level, up);
+			left_row = _mm256_blendv_epi8(left_row, _mm256_srai_epi32(left_row, 1), up);
+			left_column = _mm256_blendv_epi8(left_column, _mm256_srai_epi32(left_column, 1), up);
+		}
+		left_row = left_column = none;
+		__m256i node_row = _mm256_srav_epi32(quad_row, level), node_column = _mm256_srav_epi32(quad_column, level);
+
+		// where the rays leave their nodes
+		__m256 node_min[2] = { _mm256_cvtepi32_ps(_mm256_sllv_epi32(node_row, level)), _mm256_cvtepi32_ps(_mm256_sllv_epi32(node_column, level)) };
+		__m256 node_max[2] = { _mm256_cvtepi32_ps(_mm256_min_epi32(_mm256_sllv_epi32(_mm256_add_epi32(node_row, one), level), _mm256_add_epi32(last_row, one))),
+			_mm256_cvtepi32_ps(_mm256_min_epi32(_mm256_sllv_epi32(_mm256_add_epi32(node_column, one), level), _mm256_add_epi32(last_column, one))) };
+		__m256 t_exit = end;
+		for (int axis = 0; axis < 2; axis++) {
+			__m256 bound = _mm256_blendv_ps(node_min[axis], node_max[axis], _mm256_cmp_ps(direction[axis], _mm256_setzero_ps(), _CMP_GT_OQ));
+			__m256 axis_exit = _mm256_div_ps(_mm256_sub_ps(bound, origin[axis]), direction[axis]);
+			axis_exit = _mm256_blendv_ps(axis_exit, _mm256_set1_ps(INFINITY), _mm256_cmp_ps(direction[axis], _mm256_setzero_ps(), _CMP_EQ_OQ));
+			t_exit = _mm256_min_ps(t_exit, axis_exit);
+		}
+		t_exit = _mm256_max_ps(t_exit, _mm256_add_ps(t, probe));
+
+		__m256i node = _mm256_add_epi32(_mm256_i32gather_epi32(tree.level_offsets.data(), level, 4),
+			_mm256_add_epi32(_mm256_mullo_epi32(node_row, _mm256_i32gather_epi32(tree.columns.data(), level, 4)), node_column));
+		__m256 z_enter = _mm256_add_ps(origin[2], _mm256_mul_ps(direction[2], t)), z_exit = _mm256_add_ps(origin[2], _mm256_mul_ps(direction[2], t_exit));
+		__m256i skip = _mm256_and_si256(lanes, _mm256_castps_si256(_mm256_cmp_ps(_mm256_min_ps(z_enter, z_exit), _mm256_i32gather_ps(tree.max_heights.data(), node, 4), _CMP_GT_OQ)));
+		__m256i rest = _mm256_andnot_si256(skip, lanes);
+		__m256i below = _mm256_and_si256(rest, _mm256_castps_si256(_mm256_cmp_ps(_mm256_max_ps(z_enter, z_exit), _mm256_i32gather_ps(tree.min_heights.data(), node, 4), _CMP_LT_OQ)));
+		rest = _mm256_andnot_si256(below, rest);
+		if (any_hit) {
+			hit = _mm256_blendv_ps(hit, t, _mm256_castsi256_ps(below));
+			hit_row = _mm256_blendv_epi8(hit_row, quad_row, below);
+			hit_column = _mm256_blendv_epi8(hit_column, quad_column, below);
+			lanes = _mm256_andnot_si256(below, lanes);
+		} else {
+			skip = _mm256_or_si256(skip, below);
+		}
+		__m256i down = _mm256_and_si256(rest, _mm256_cmpgt_epi32(level, zero));
+		level = _mm256_add_epi32(level, down);
+
+		__m256i at_quads = _mm256_andnot_si256(down, rest), advance = skip;
+		if (!_mm256_testz_si256(at_quads, at_quads)) {
+			__m256 quad_hit = intersect_quad_packet(tree, origin, direction, quad_row, quad_column, t, t_exit);
+			__m256i found = _mm256_and_si256(at_quads, _mm256_castps_si256(_mm256_cmp_ps(quad_hit, _mm256_set1_ps(INFINITY), _CMP_LT_OQ)));
+			hit = _mm256_blendv_ps(hit, quad_hit, _mm256_castsi256_ps(found));
+			hit_row = _mm256_blendv_epi8(hit_row, quad_row, found);
+			hit_column = _mm256_blendv_epi8(hit_column, quad_column, found);
+			lanes = _mm256_andnot_si256(found, lanes);
+			advance = _mm256_or_si256(advance, _mm256_andnot_si256(found, at_quads));
+		}
+		t = _mm256_blendv_ps(t, t_exit, _mm256_castsi256_ps(advance));
+		left_row = _mm256_blendv_epi8(left_row, node_row, advance);
+		left_column = _mm256_blendv_epi8(left_column, node_column, advance);
+	}
+
+	alignas(32) int lane_level[8], lane_left_row[8], lane_left_column[8];
+	_mm256_store_ps(hits, hit);
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(rows), hit_row);
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(columns), hit_column);
+	_mm256_store_ps(lane_t, t);
+	_mm256_store_si256(reinterpret_cast<__m256i*>(lane_level), level);
+	_mm256_store_si256(reinterpret_cast<__m256i*>(lane_left_row), left_row);
+	_mm256_store_si256(reinterpret_cast<__m256i*>(lane_left_column), left_column);
+	int remaining = _mm256_movemask_ps(_mm256_castsi256_ps(lanes));
+	for (int lane = 0; lane < 8; lane++) {
+		if (remaining >> lane & 1) {
+			t_quadtree_walk walk = { lane_t[lane], lane_level[lane], lane_left_row[lane], lane_left_column[lane] };
+			hits[lane] = walk_height_quadtree(tree, rays[lane], walk, lane_end[lane], any_hit, rows[lane], columns[lane]);
 		}
 	}
 }
+#endif
+
+// how much of the shade is left in the sun's shadow
+const float SHADOW_FACTOR = 0.5f;
+
+// Casts one primary ray per pixel center against the mesh surface, so visibility is exact, and one shadow ray towards
+// the sun from every hit. The normal is interpolated across the hit triangle and shaded per pixel. Both rays skip
+// empty space through the max mipmap, so the cost per ray grows with the log of the grid size. With AVX2 the rays of
+// 4 x 2 pixel blocks are traced as packets, see trace_height_quadtree_packet. Rows of pixels are split across the
+// threads; depth (1 / w) is written like the software rasterizer does.
+void render_ray_trace(t_thread_pool& pool, const t_view& view, const t_height_quadtree& tree, t_framebuffer& framebuffer) {
+	int width = view.viewport_width, height = view.viewport_height;
+	framebuffer.width = width;
+	framebuffer.height = height;
+	framebuffer.color.resize(static_cast<size_t>(width) * height);
+	framebuffer.depth.resize(static_cast<size_t>(width) * height);
+
+	float focal_length = view.perspective_factor * view.zoom_factor;
+	Eigen::Matrix3f view_to_world = view.view_matrix.transpose();
+	Eigen::Vector3f towards_sun = -light_direction.normalized();
+	t_grid_ray sun_direction = to_grid_ray(tree, view.exaggeration, Eigen::Vector3f::Zero(), towards_sun);
+	// Shadow rays skip the first quad they cross. The shading normal is smooth but the triangles are not, so triangles
+	// near the terminator would otherwise shadow their neighbours in facet shaped patches.
+	float shadow_begin = 1.0f / std::max({ abs(sun_direction.direction.x()), abs(sun_direction.direction.y()), 1e-6f });
+	uint32_t background = pack_color(0xC0, 0xC0, 0xC0);
+
+	// the inverse of view_to_pixel_coordinates at view depth 1, screen y points down
+	auto primary_ray = [&](int x, int y) {
+		Eigen::Vector3f direction = view_to_world * Eigen::Vector3f((x + 0.5f - width / 2.0f) / focal_length, (height / 2.0f - y - 0.5f) / focal_length, -1.0f);
+		return to_grid_ray(tree, view.exaggeration, view.camera_position, direction);
+	};
+	auto shadow_ray = [&](const t_grid_ray& ray, float t) {
+		t_grid_ray shadow;
+		shadow.origin = ray.origin + ray.direction * t;
+		shadow.direction = sun_direction.direction;
+		return shadow;
+	};
+	auto write_hit = [&](size_t pixel, const t_grid_ray& ray, float t, int row, int column, bool in_shadow) {
+		// blend the corner normals of the triangle that was hit
+		float a = std::clamp(ray.origin.x() + ray.direction.x() * t - row, 0.0f, 1.0f);
+		float b = std::clamp(ray.origin.y() + ray.direction.y() * t - column, 0.0f, 1.0f);
+		const Eigen::Vector3f* normal = &tree.normals[static_cast<size_t>(row) * tree.sample_columns + column];
+		const Eigen::Vector3f* below = normal + tree.sample_columns;
+		Eigen::Vector3f blended = a + b <= 1.0f
+			? ((1.0f - a - b) * normal[0] + b * normal[1] + a * below[0]).eval()
+			: ((a + b - 1.0f) * below[1] + (1.0f - a) * normal[1] + (1.0f - b) * below[0]).eval();
+		SDL_Color color = shade(exaggerate_normal(blended, view.exaggeration));
+		float factor = in_shadow ? SHADOW_FACTOR : 1.0f;
+		framebuffer.color[pixel] = pack_color(static_cast<uint8_t>(color.r * factor), static_cast<uint8_t>(color.g * factor), static_cast<uint8_t>(color.b * factor));
+		framebuffer.depth[pixel] = 1.0f / t; // the ray direction has view depth 1
+	};
+
+#ifdef __AVX2__
+	int packet_columns = (width + 3) / 4;
+	parallel_for(pool, (height + 1) / 2, [&](int begin, int end) {
+		for (int packet_row = begin; packet_row < end; packet_row++) {
+			for (int packet_column = 0; packet_column < packet_columns; packet_column++) {
+				t_grid_ray rays[8], shadow_rays[8];
+				alignas(32) float hits[8], blocked[8];
+				int rows[8], columns[8], blocker_rows[8], blocker_columns[8];
+				size_t pixels[8];
+				int active = 0;
+				for (int lane = 0; lane < 8; lane++) {
+					int x = packet_column * 4 + lane % 4, y = packet_row * 2 + lane / 4;
+					if (x < width && y < height)
+						active |= 1 << lane;
+					rays[lane] = primary_ray(std::min(x, width - 1), std::min(y, height - 1));
+					pixels[lane] = static_cast<size_t>(std::min(y, height - 1)) * width + std::min(x, width - 1);
+				}
+				trace_height_quadtree_packet(tree, rays, active, NEAR_PLANE, FAR_PLANE, false, hits, rows, columns);
+
+				int lit = 0;
+				for (int lane = 0; lane < 8; lane++) {
+					shadow_rays[lane] = shadow_ray(rays[lane], hits[lane] < INFINITY ? hits[lane] : 0.0f);
+					if (!(active >> lane & 1))
+						continue;
+					if (hits[lane] < INFINITY) {
+						lit |= 1 << lane;
+					} else {
+						framebuffer.color[pixels[lane]] = background;
+						framebuffer.depth[pixels[lane]] = 0.0f;
+					}
+				}
+				trace_height_quadtree_packet(tree, shadow_rays, lit, shadow_begin, FAR_PLANE, true, blocked, blocker_rows, blocker_columns);
+				for (int lane = 0; lane < 8; lane++) {
+					if (lit >> lane & 1)
+						write_hit(pixels[lane], rays[lane], hits[lane], rows[lane], columns[lane], blocked[lane] < INFINITY);
+				}
+			}
+		}
+	}, 2);
+#else
+	parallel_for(pool, height, [&](int begin, int end) {
+		for (int y = begin; y < end; y++) {
+			for (int x = 0; x < width; x++) {
+				size_t pixel = static_cast<size_t>(y) * width + x;
+				t_grid_ray ray = primary_ray(x, y);
+				int row, column;
+				float t = trace_height_quadtree(tree, ray, NEAR_PLANE, FAR_PLANE, false, row, column);
+				if (t == INFINITY) {
+					framebuffer.color[pixel] = background;
+					framebuffer.depth[pixel] = 0.0f;
+					continue;
+				}
+				int blocker_row, blocker_column;
+				bool in_shadow = trace_height_quadtree(tree, shadow_ray(ray, t), shadow_begin, FAR_PLANE, true, blocker_row, blocker_column) < INFINITY;
+				write_hit(pixel, ray, t, row, column, in_shadow);
+			}
+		}
+	}, 4);
+#endif
+}
 
-// this data structure is used to keep track of indices of SDL_triangles we want to render
-typedef struct s_triangle {
-	int i; // index of first point, by convertion i+1 and i+2 are the indices of the next points
-	float depth;
-}t_triangle;
+// everything the backends draw from, each part is built when a backend first needs it
+typedef struct s_terrain {
+	t_mesh mesh;
+	t_height_pyramid pyramid;
+	t_height_quadtree quadtree;
+	t_rtin rtin;
+	t_mesh adaptive_mesh;
+	float adaptive_mesh_error = -1.0f; // the tolerance adaptive_mesh was cut at
+	t_clipmap clipmap;
+	t_tin tin; // loaded from a file, drawn in place of the grid when it has triangles
+} t_terrain;
 
-// ascending sort for painter's algorithm
-bool t_triangle_sorter(t_triangle& lhs, t_triangle& rhs) {
-	return lhs.depth > rhs.depth;
+// the mesh the triangle backends draw
+inline const t_mesh& terrain_mesh(const t_terrain& terrain) {
+	if (clipmap_terrain)
+		return terrain.clipmap.mesh;
+	return adaptive_mesh ? terrain.adaptive_mesh : terrain.mesh;
 }
 
-void depth_order(const std::vector<t_vertex3d>& verticies, std::vector<int> &index_list) {
-	std::vector<t_triangle> triangles;
-	for (int i = 0; i < verticies.size(); i += 3) {
-		t_triangle temp;
-		temp.i = i;
-		temp.depth = abs(verticies[i].position.z() + verticies[i + 1].position.z() + verticies[i + 2].position.z());
-		triangles.push_back(temp);
+// builds whatever the current backend draws from and is not built yet, so a map too large for a mesh can still be
+// looked at in voxel space
+void prepare_terrain(int** heightmap, int width, int height, t_terrain& terrain) {
+	if (render_backend == BACKEND_VOXEL_SPACE) {
+		if (terrain.pyramid.levels.empty())
+			build_height_pyramid(heightmap, width, height, terrain.pyramid);
+	} else if (render_backend == BACKEND_RAY_TRACE) {
+		if (terrain.quadtree.max_heights.empty())
+			build_height_quadtree(heightmap, width, height, terrain.quadtree);
+	} else if (clipmap_terrain) {
+		if (terrain.clipmap.levels[0].heights.empty())
+			build_clipmap(heightmap, width, height, terrain.clipmap);
+		update_clipmap(terrain.clipmap, camera_position); // follows the camera, so every redraw
+	} else if (adaptive_mesh) {
+		if (terrain.rtin.errors.empty())
+			build_rtin(heightmap, width, height, terrain.rtin);
+		if (terrain.adaptive_mesh_error != adaptive_mesh_error) {
+			rtin_mesh(heightmap, terrain.rtin, adaptive_mesh_error, terrain.adaptive_mesh);
+			terrain.adaptive_mesh_error = adaptive_mesh_error;
+		}
+	} else {
+		if (terrain.mesh.verticies.empty()) {
+			if (!terrain.tin.triangles.empty())
+				tin_mesh(terrain.tin, terrain.mesh);
+			else
+				tris_from_heightmap(heightmap, width, height, terrain.mesh);
+		}
+		if (level_of_detail && !terrain.mesh.has_levels && terrain.mesh.chunk_columns > 0)
+			build_chunk_levels(heightmap, width, height, terrain.mesh);
+	}
+}
+
+// the stages between projection and drawing: the painter's order for SDL_RenderGeometry, or culling for the rasterizer
+void order_triangles(const t_mesh& mesh, const t_view& view, t_frame& frame) {
+	// the grid order walks the full grid's quads, so other meshes are depth sorted and not horizon culled
+	bool grid = mesh.chunk_columns > 0 && !drawing_levels(mesh);
+	if (render_backend == BACKEND_SOFTWARE) {
+		frame.previous_order_valid = false; // the remembered order goes stale while no order is computed
+		if (horizon_culling && grid) {
+			// the culling needs the grid order, the depth buffer then only sees the survivors
+			grid_order(mesh, view, frame, frame.index_list);
+			horizon_cull(view, frame);
+			frame.visible_triangles.clear();
+			for (size_t k = 0; k < frame.index_list.size(); k += 3)
+				frame.visible_triangles.push_back(frame.index_list[k] / 3);
+		}
+		return;
 	}
-	std::sort(triangles.begin(), triangles.end(), &t_triangle_sorter);
-	for (int i = 0; i < verticies.size() / 3; i ++) {
-		index_list.push_back(triangles[i].i);
-		index_list.push_back(triangles[i].i + 1);
-		index_list.push_back(triangles[i].i + 2);
+
+	// index_list provides the order in which the triangles should be rendered
+	if (sort_mode == SORT_INCREMENTAL) {
+		incremental_depth_order(frame, view);
+	} else {
+		frame.previous_order_valid = false; // the remembered order goes stale while another mode is used
+		if (sort_mode == SORT_GRID && grid)
+			grid_order(mesh, view, frame, frame.index_list);
+		else
+			depth_order(frame);
 	}
+	// only the grid order is exact enough for the horizon to tell what is in front
+	if (horizon_culling && sort_mode == SORT_GRID && grid)
+		horizon_cull(view, frame);
 }
 
-// TODO this still makes a copy per call
-void draw_heightmap(SDL_Renderer* renderer, std::vector<t_vertex3d> verticies) {
+void draw_heightmap(SDL_Renderer* renderer, const t_terrain& terrain, t_frame& frame) {
 	// We render with a color of choice at a time			
 	SDL_SetRenderDrawColor(renderer, 0xC0, 0xC0, 0xC0, 0xFF); // white background
 	SDL_RenderClear(renderer);
 	SDL_SetRenderDrawBlendMode(renderer, SDL_BlendMode::SDL_BLENDMODE_BLEND);
 
-	to_pixel_coordinates_verticies(verticies);
-	
-	std::vector<int> index_list;
-	depth_order(verticies, index_list); // index_list provides the order in which the triangles should be rendered
-
-	std::vector<SDL_Vertex> sdl_verticies;
+	t_view view;
+	build_view(view);
+	if (!backend_draws_triangles(render_backend)) {
+		frame.previous_order_valid = false; // the remembered order goes stale while no order is computed
+		if (render_backend == BACKEND_VOXEL_SPACE)
+			render_voxel_space(thread_pool, view, terrain.pyramid, frame.framebuffer);
+		else
+			render_ray_trace(thread_pool, view, terrain.quadtree, frame.framebuffer);
+		present_framebuffer(renderer, frame.framebuffer, frame.framebuffer_texture);
+		SDL_RenderPresent(renderer);
+		return;
+	}
 
-	for (t_vertex3d& v : verticies)
-	{
-		// SDL vertices are 2D, so that is why I created my own data struct
-		SDL_Vertex temp;
-		
-		temp.position.x = v.position.x();
-		temp.position.y = SCREEN_HEIGHT - v.position.y();
-		
-		// recompute shading 
-		compute_color(v);
-		temp.color = v.color; 
+	project_triangles(terrain_mesh(terrain), view, frame);
+	order_triangles(terrain_mesh(terrain), view, frame);
 
-		sdl_verticies.push_back(temp);
+	if (render_backend == BACKEND_SOFTWARE) {
+		rasterize_frame(thread_pool, view, frame, frame.framebuffer);
+		present_framebuffer(renderer, frame.framebuffer, frame.framebuffer_texture);
+		SDL_RenderPresent(renderer);
+		return;
 	}
 
-	SDL_RenderGeometry(renderer, NULL, &(sdl_verticies[0]), verticies.size(), &(index_list[0]), index_list.size());
+	if (!frame.index_list.empty())
+		SDL_RenderGeometry(renderer, NULL, &(frame.sdl_verticies[0]), static_cast<int>(frame.sdl_verticies.size()), &(frame.index_list[0]), static_cast<int>(frame.index_list.size()));
 	
 	SDL_RenderPresent(renderer); // Present the render, otherwise what has been drawn will not be seen
 }
 
-// TODO find a more efficient way of doing this than making a copy of the lines data structure
-// TODO: just make a new transform matrix every time?
-void draw_heightmap(SDL_Renderer *renderer, std::vector<Line3f> lines) {
+// every sample is transformed once, then the rows and columns go to SDL as polylines
+void draw_wireframe(SDL_Renderer* renderer, const t_view& view, t_wireframe& wireframe) {
 	// We render with a color of choice at a time			
 	SDL_SetRenderDrawColor(renderer, 0x5F, 0x00, 0x00, 0xFF); // red background
 	SDL_RenderClear(renderer);
 	SDL_SetRenderDrawBlendMode(renderer, SDL_BlendMode::SDL_BLENDMODE_BLEND);
 	SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0xFF, 0xAF);
-	
-	to_pixel_coordinates_lines(lines);
-	
-	for (const Line3f &line : lines)
-	{
-		SDL_RenderDrawLine(renderer, line.col(0).x(), SCREEN_HEIGHT - line.col(0).y(), line.col(1).x(), SCREEN_HEIGHT - line.col(1).y());
+
+	wireframe.view_points.resize(wireframe.points.size());
+	for (size_t k = 0; k < wireframe.points.size(); k++)
+		wireframe.view_points[k] = terrain_to_view_space(view, wireframe.points[k]);
+
+	for (int i = 0; i < wireframe.rows; i++)
+		draw_polyline(renderer, view, wireframe, static_cast<size_t>(i) * wireframe.columns, 1, wireframe.columns);
+	for (int j = 0; j < wireframe.columns; j++)
+		draw_polyline(renderer, view, wireframe, j, wireframe.columns, wireframe.rows);
+}
+
+// The software backend draws only the visible lines, against the depth of the terrain mesh; every other backend draws
+// all of them through SDL.
+void draw_heightmap(SDL_Renderer* renderer, const t_terrain& terrain, t_wireframe& wireframe, t_frame& frame) {
+	t_view view;
+	build_view(view);
+	if (render_backend == BACKEND_SOFTWARE) {
+		project_triangles(terrain_mesh(terrain), view, frame);
+		order_triangles(terrain_mesh(terrain), view, frame);
+		rasterize_wireframe(thread_pool, view, frame, wireframe);
+		present_framebuffer(renderer, frame.framebuffer, frame.framebuffer_texture);
+	} else {
+		draw_wireframe(renderer, view, wireframe);
 	}
+
 	// Present the render, otherwise what has been drawn will not be seen
 	SDL_RenderPresent(renderer);
 }
 
-void game_loop(SDL_Renderer* renderer, int** heightmap, int width, int height) {
+// what the command line asked of a headless run
+typedef struct s_headless_options {
+	const char* output_path;
+	int width = SCREEN_WIDTH, height = SCREEN_HEIGHT;
+	int frames = 1; // timings are averaged over this many renders of the same view
+	bool wireframe = false;
+	const char* tin_path = NULL; // drawn in place of the grid, see load_tin
+} t_headless_options;
+
+inline double milliseconds_since(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Renders one view without a window and writes it to a PNG. All but the SDL backend draw into the in-memory
+// framebuffer, the SDL backend into a surface through SDL's software renderer, which needs no video device either.
+// Prints the average time of every stage.
+int render_headless(int** heightmap, int width, int height, const t_headless_options& options) {
+	std::chrono::steady_clock::time_point build_start = std::chrono::steady_clock::now();
+	t_terrain terrain;
+	t_wireframe wireframe;
+	if (options.tin_path != NULL && !load_terrain_tin(options.tin_path, width, height, terrain.tin))
+		return -1;
+	if (!options.wireframe || render_backend == BACKEND_SOFTWARE)
+		prepare_terrain(heightmap, width, height, terrain);
+	if (options.wireframe)
+		wireframe_from_heightmap(heightmap, width, height, wireframe);
+	double build_time = milliseconds_since(build_start);
+
+	t_frame frame;
+	t_view view;
+	build_view(view, options.width, options.height);
+
+	SDL_Surface* surface = NULL;
+	SDL_Renderer* renderer = NULL;
+	if (render_backend == BACKEND_SDL_GEOMETRY) {
+		surface = SDL_CreateRGBSurfaceWithFormat(0, options.width, options.height, 32, SDL_PIXELFORMAT_RGBA32);
+		renderer = surface != NULL ? SDL_CreateSoftwareRenderer(surface) : NULL;
+		if (renderer == NULL) {
+			printf("Could not create the offscreen renderer! SDL_Error: %s\n", SDL_GetError());
+			if (surface != NULL)
+				SDL_FreeSurface(surface);
+			return -1;
+		}
+	}
+
+	double project_time = 0.0, order_time = 0.0, draw_time = 0.0;
+	for (int run = 0; run < options.frames; run++) {
+		std::chrono::steady_clock::time_point start;
+		if (backend_draws_triangles(render_backend) && !(options.wireframe && render_backend == BACKEND_SDL_GEOMETRY)) {
+			start = std::chrono::steady_clock::now();
+			project_triangles(terrain_mesh(terrain), view, frame);
+			project_time += milliseconds_since(start);
+
+			start = std::chrono::steady_clock::now();
+			order_triangles(terrain_mesh(terrain), view, frame);
+			order_time += milliseconds_since(start);
+		}
+
+		start = std::chrono::steady_clock::now();
+		if (options.wireframe) {
+			if (render_backend == BACKEND_SOFTWARE)
+				rasterize_wireframe(thread_pool, view, frame, wireframe);
+			else
+				draw_wireframe(renderer, view, wireframe);
+		} else if (render_backend == BACKEND_VOXEL_SPACE) {
+			render_voxel_space(thread_pool, view, terrain.pyramid, frame.framebuffer);
+		} else if (render_backend == BACKEND_RAY_TRACE) {
+			render_ray_trace(thread_pool, view, terrain.quadtree, frame.framebuffer);
+		} else if (render_backend == BACKEND_SOFTWARE) {
+			rasterize_frame(thread_pool, view, frame, frame.framebuffer);
+		} else {
+			SDL_SetRenderDrawColor(renderer, 0xC0, 0xC0, 0xC0, 0xFF);
+			SDL_RenderClear(renderer);
+			if (!frame.index_list.empty())
+				SDL_RenderGeometry(renderer, NULL, &(frame.sdl_verticies[0]), static_cast<int>(frame.sdl_verticies.size()), &(frame.index_list[0]), static_cast<int>(frame.index_list.size()));
+		}
+		draw_time += milliseconds_since(start);
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	if (render_backend == BACKEND_SDL_GEOMETRY) {
+		// the surface rows may be padded, the framebuffer's are not
+		frame.framebuffer.width = options.width;
+		frame.framebuffer.height = options.height;
+		frame.framebuffer.color.resize(options.width * options.height);
+		for (int y = 0; y < options.height; y++)
+			memcpy(&frame.framebuffer.color[y * options.width], static_cast<uint8_t*>(surface->pixels) + y * surface->pitch, options.width * sizeof(uint32_t));
+		SDL_DestroyRenderer(renderer);
+		SDL_FreeSurface(surface);
+	}
+	unsigned error = lodepng::encode(options.output_path, reinterpret_cast<const unsigned char*>(frame.framebuffer.color.data()), options.width, options.height);
+	double encode_time = milliseconds_since(start);
+	if (error) {
+		std::cout << "encoder error " << error << ": " << lodepng_error_text(error) << std::endl;
+		return -1;
+	}
+
+	int drawn = static_cast<int>(render_backend == BACKEND_SOFTWARE ? frame.visible_triangles.size() : frame.index_list.size() / 3);
+	const char* backend_names[BACKEND_COUNT] = { "SDL geometry", "software", "voxel space", "ray trace" };
+	if (options.wireframe)
+		printf("%d x %d wireframe drawn at %dx%d, %s backend, average of %d frames\n", wireframe.rows, wireframe.columns,
+			options.width, options.height, backend_names[render_backend], options.frames);
+	else if (render_backend == BACKEND_VOXEL_SPACE)
+		printf("%d columns marched at %dx%d, %s backend, average of %d frames\n", options.width,
+			options.width, options.height, backend_names[render_backend], options.frames);
+	else if (render_backend == BACKEND_RAY_TRACE)
+		printf("%d primary rays traced at %dx%d, %s backend, average of %d frames\n", options.width * options.height,
+			options.width, options.height, backend_names[render_backend], options.frames);
+	else
+		printf("%d triangles drawn at %dx%d, %s backend, average of %d frames\n", drawn,
+			options.width, options.height, backend_names[render_backend], options.frames);
+	printf("build    %8.3f ms (once)\n", build_time);
+	printf("project  %8.3f ms\n", project_time / options.frames);
+	printf("order    %8.3f ms\n", order_time / options.frames);
+	printf("draw     %8.3f ms\n", draw_time / options.frames);
+	printf("encode   %8.3f ms (once, %s)\n", encode_time, options.output_path);
+	return 0;
+}
+
+// Reads the options following --headless <output.png>, returns false on anything it does not understand:
+//   --size <width> <height>, --camera <x> <y> <z>, --light <x> <y> <z>, --exaggeration <factor>,
+//   --backend sdl|software|voxel|ray, --frames <count>, --sort depth|grid|incremental, --horizon-culling,
+//   --wireframe (the SDL and software backends only), --edge-overlay (the software backend only), --lod,
+//   --adaptive-mesh <max error>
+// Camera, light and exaggeration are global state shared with the interactive mode, so they are set directly.
+bool parse_headless_options(int argc, char* args[], t_headless_options& options) {
+	if (argc < 3)
+		return false;
+	options.output_path = args[2];
+	for (int k = 3; k < argc; k++) {
+		int remaining = argc - k - 1;
+		if (strcmp(args[k], "--size") == 0 && remaining >= 2) {
+			options.width = atoi(args[k + 1]);
+			options.height = atoi(args[k + 2]);
+			k += 2;
+		} else if (strcmp(args[k], "--camera") == 0 && remaining >= 3) {
+			camera_position = Eigen::Vector3f(strtof(args[k + 1], NULL), strtof(args[k + 2], NULL), strtof(args[k + 3], NULL));
+			perspective_factor = camera_position.norm();
+			k += 3;
+		} else if (strcmp(args[k], "--light") == 0 && remaining >= 3) {
+			light_direction = Eigen::Vector3f(strtof(args[k + 1], NULL), strtof(args[k + 2], NULL), strtof(args[k + 3], NULL)).normalized();
+			k += 3;
+		} else if (strcmp(args[k], "--exaggeration") == 0 && remaining >= 1) {
+			vertical_exaggeration = strtof(args[k + 1], NULL);
+			k += 1;
+		} else if (strcmp(args[k], "--backend") == 0 && remaining >= 1) {
+			if (strcmp(args[k + 1], "sdl") == 0)
+				render_backend = BACKEND_SDL_GEOMETRY;
+			else if (strcmp(args[k + 1], "software") == 0)
+				render_backend = BACKEND_SOFTWARE;
+			else if (strcmp(args[k + 1], "voxel") == 0)
+				render_backend = BACKEND_VOXEL_SPACE;
+			else if (strcmp(args[k + 1], "ray") == 0)
+				render_backend = BACKEND_RAY_TRACE;
+			else
+				return false;
+			k += 1;
+		} else if (strcmp(args[k], "--sort") == 0 && remaining >= 1) {
+			if (strcmp(args[k + 1], "depth") == 0)
+				sort_mode = SORT_DEPTH;
+			else if (strcmp(args[k + 1], "grid") == 0)
+				sort_mode = SORT_GRID;
+			else if (strcmp(args[k + 1], "incremental") == 0)
+				sort_mode = SORT_INCREMENTAL;
+			else
+				return false;
+			k += 1;
+		} else if (strcmp(args[k], "--frames") == 0 && remaining >= 1) {
+			options.frames = atoi(args[k + 1]);
+			k += 1;
+		} else if (strcmp(args[k], "--horizon-culling") == 0) {
+			horizon_culling = true;
+		} else if (strcmp(args[k], "--wireframe") == 0) {
+			options.wireframe = true;
+		} else if (strcmp(args[k], "--edge-overlay") == 0) {
+			edge_overlay = true;
+		} else if (strcmp(args[k], "--lod") == 0) {
+			level_of_detail = true;
+		} else if (strcmp(args[k], "--adaptive-mesh") == 0 && remaining >= 1) {
+			adaptive_mesh = true;
+			adaptive_mesh_error = strtof(args[k + 1], NULL);
+			k += 1;
+		} else if (strcmp(args[k], "--clipmap") == 0) {
+			clipmap_terrain = true;
+		} else if (strcmp(args[k], "--tin") == 0 && remaining >= 1) {
+			options.tin_path = args[k + 1];
+			k += 1;
+		} else {
+			return false;
+		}
+	}
+	return options.width > 0 && options.height > 0 && options.frames > 0 && camera_position.norm() > 0.0f && vertical_exaggeration > 0.0f
+		&& (!options.wireframe || backend_draws_triangles(render_backend));
+}
+
+// The offline side of --build-tin: builds the TIN of the heightmap with the given options, writes it and prints how
+// it compares to the full grid.
+int build_tin_file(int** heightmap, int width, int height, int argc, char* args[]) {
+	const char* output_path = args[2];
+	float max_error = 1.0f;
+	int max_triangles = 0;
+	for (int k = 3; k < argc; k++) {
+		int remaining = argc - k - 1;
+		if (strcmp(args[k], "--max-error") == 0 && remaining >= 1) {
+			max_error = strtof(args[k + 1], NULL);
+			k += 1;
+		} else if (strcmp(args[k], "--max-triangles") == 0 && remaining >= 1) {
+			max_triangles = atoi(args[k + 1]);
+			k += 1;
+		} else {
+			printf("usage: --build-tin <output.tin> [--max-error <e>] [--max-triangles <count>]\n");
+			return -1;
+		}
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	t_tin tin;
+	float error = build_tin(heightmap, width, height, max_error, max_triangles, tin);
+	double build_time = milliseconds_since(start);
+	if (!save_tin(output_path, tin)) {
+		printf("Could not write %s\n", output_path);
+		return -1;
+	}
+
+	long long grid_triangles = 2LL * (width - 1) * (height - 1);
+	size_t bytes = sizeof(TIN_MAGIC) + 16 + 6 * tin.points.size() + 4 * tin.triangles.size();
+	printf("%zu points, %zu triangles (%.1f%% of the grid's %lld), max error %.2f, built in %.1f ms\n", tin.points.size(), tin.triangles.size() / 3,
+		100.0 * tin.triangles.size() / 3 / grid_triangles, grid_triangles, error, build_time);
+	printf("%zu bytes written to %s\n", bytes, output_path);
+	return 0;
+}
+
+// tin_path, if not NULL, is a TIN file drawn in place of the grid
+void game_loop(SDL_Renderer* renderer, int** heightmap, int width, int height, const char* tin_path) {
 	bool quit{ false };
 	bool wireframe_rendering{ false };
 	SDL_Event e;
 
-	// pre-processing (things that will not be updated between rendering frames)
-	std::vector<t_vertex3d> verticies;
-	tris_from_heightmap(heightmap, width, height, verticies);
+	// pre-processing (things that will not be updated between rendering frames), built when a backend first needs it
+	t_terrain terrain;
+	if (tin_path != NULL && !load_terrain_tin(tin_path, width, height, terrain.tin))
+		return;
+	prepare_terrain(heightmap, width, height, terrain);
+	t_wireframe wireframe; // built when first shown
+	t_frame frame;
 	// draw initial view
-	draw_heightmap(renderer, verticies);
+	draw_heightmap(renderer, terrain, frame);
 
 	// Handle events on queue
 	while (!quit) {
@@ -326,6 +3989,8 @@ void game_loop(SDL_Renderer* renderer, int** heightmap, int width, int height) {
 			// User requests quit
 			if (e.type == SDL_QUIT)
 			{
+				if (frame.framebuffer_texture != NULL)
+					SDL_DestroyTexture(frame.framebuffer_texture);
 				return;
 			}
 			// User presses a key
@@ -374,6 +4039,60 @@ void game_loop(SDL_Renderer* renderer, int** heightmap, int width, int height) {
 					wireframe_rendering = !wireframe_rendering;
 					break;
 
+				case SDLK_b:
+					backface_culling = !backface_culling;
+					break;
+
+				case SDLK_s:
+					sort_mode = static_cast<t_sort_mode>((sort_mode + 1) % SORT_MODE_COUNT);
+					break;
+
+				case SDLK_r:
+					render_backend = static_cast<t_render_backend>((render_backend + 1) % BACKEND_COUNT);
+					break;
+
+				case SDLK_h:
+					horizon_culling = !horizon_culling;
+					break;
+
+				case SDLK_g:
+					edge_overlay = !edge_overlay;
+					break;
+
+				case SDLK_l:
+					level_of_detail = !level_of_detail;
+					break;
+
+				case SDLK_m:
+					adaptive_mesh = !adaptive_mesh;
+					break;
+
+				case SDLK_c:
+					clipmap_terrain = !clipmap_terrain;
+					break;
+
+				// the adaptive mesh's error slider
+				case SDLK_MINUS:
+					adaptive_mesh_error = adaptive_mesh_error / ADAPTIVE_MESH_ERROR_STEP < ADAPTIVE_MESH_MIN_ERROR ? 0.0f : adaptive_mesh_error / ADAPTIVE_MESH_ERROR_STEP;
+					printf("adaptive mesh max error %.2f\n", adaptive_mesh_error);
+					break;
+
+				case SDLK_EQUALS:
+					adaptive_mesh_error = std::max(ADAPTIVE_MESH_MIN_ERROR, adaptive_mesh_error * ADAPTIVE_MESH_ERROR_STEP);
+					printf("adaptive mesh max error %.2f\n", adaptive_mesh_error);
+					break;
+
+				// vertical exaggeration, applied in the view transform so nothing is rebuilt
+				case SDLK_COMMA:
+					vertical_exaggeration /= EXAGGERATION_STEP;
+					printf("vertical exaggeration %.2f\n", vertical_exaggeration);
+					break;
+
+				case SDLK_PERIOD:
+					vertical_exaggeration *= EXAGGERATION_STEP;
+					printf("vertical exaggeration %.2f\n", vertical_exaggeration);
+					break;
+
 				default:
 					// error if a diff key is pressed to check behaviour
 					assert(false);
@@ -381,11 +4100,14 @@ void game_loop(SDL_Renderer* renderer, int** heightmap, int width, int height) {
 				}
 				// only redraw if view changed
 				if (wireframe_rendering) {
-					std::vector<Line3f> lines;
-					lines_from_heightmap(heightmap, width, height, lines);
-					draw_heightmap(renderer, lines);
+					if (wireframe.points.empty())
+						wireframe_from_heightmap(heightmap, width, height, wireframe);
+					if (render_backend == BACKEND_SOFTWARE)
+						prepare_terrain(heightmap, width, height, terrain); // the depth the lines are tested against
+					draw_heightmap(renderer, terrain, wireframe, frame);
 				} else {
-					draw_heightmap(renderer, verticies);
+					prepare_terrain(heightmap, width, height, terrain);
+					draw_heightmap(renderer, terrain, frame);
 				}
 			}
 		}
@@ -395,6 +4117,17 @@ void game_loop(SDL_Renderer* renderer, int** heightmap, int width, int height) {
 // SDL requires specifically this signature for main
 int main(int argc, char* args[])
 {
+	// usage: --benchmark-sort [triangle count], times the depth sort with every thread count and exits
+	if (argc >= 2 && strcmp(args[1], "--benchmark-sort") == 0) {
+		int triangle_count = argc >= 3 ? atoi(args[2]) : 10000000;
+		if (triangle_count <= 0) {
+			printf("usage: --benchmark-sort [triangle count > 0]\n");
+			return -1;
+		}
+		benchmark_sort(triangle_count);
+		return 0;
+	}
+
 	std::vector<unsigned char> image; //the raw pixels
 	unsigned width, height;
 
@@ -421,11 +4154,42 @@ int main(int argc, char* args[])
 		}
 	}
 
+	// one worker per remaining core, the main thread does its share of every parallel_for
+	thread_pool_start(thread_pool, std::max(1u, std::thread::hardware_concurrency()));
+
 	// The window we'll be rendering to
 	SDL_Window* window = NULL;
+	int exit_code = 0;
 
+	// usage: --benchmark-raster, times the software rasterizer at window and 4K size with every thread count
+	if (argc >= 2 && strcmp(args[1], "--benchmark-raster") == 0)
+	{
+		t_mesh mesh;
+		tris_from_heightmap(pixelValues, width, height, mesh);
+		benchmark_raster(mesh, SCREEN_WIDTH, SCREEN_HEIGHT);
+		benchmark_raster(mesh, 3840, 2160);
+	}
+	// usage: --build-tin <output.tin> [--max-error <e>] [--max-triangles <count>], simplifies the heightmap into a TIN
+	else if (argc >= 3 && strcmp(args[1], "--build-tin") == 0)
+	{
+		exit_code = build_tin_file(pixelValues, width, height, argc, args);
+	}
+	// usage: --headless <output.png> [options], renders one view to a PNG without a window, see parse_headless_options
+	else if (argc >= 2 && strcmp(args[1], "--headless") == 0)
+	{
+		t_headless_options options;
+		if (!parse_headless_options(argc, args, options)) {
+			printf("usage: --headless <output.png> [--size <width> <height>] [--camera <x> <y> <z>] [--light <x> <y> <z>]\n"
+				"                  [--exaggeration <factor>] [--backend sdl|software|voxel|ray] [--sort depth|grid|incremental] [--horizon-culling]\n"
+				"                  [--wireframe] [--edge-overlay] [--lod] [--adaptive-mesh <max error>] [--clipmap] [--tin <file.tin>]\n"
+				"                  [--frames <count>]\n");
+			exit_code = -1;
+		} else {
+			exit_code = render_headless(pixelValues, width, height, options);
+		}
+	}
 	// Initialize SDL
-	if (SDL_Init(SDL_INIT_VIDEO) < 0)
+	else if (SDL_Init(SDL_INIT_VIDEO) < 0)
 	{
 		printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
 	}
@@ -440,13 +4204,16 @@ int main(int argc, char* args[])
 		else
 		{
 			SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED); // TODO error handle this maybe
-			game_loop(renderer, pixelValues, width, height);
+			// usage: --tin <file.tin>, shows a TIN made by --build-tin instead of the heightmap's grid
+			game_loop(renderer, pixelValues, width, height, argc >= 3 && strcmp(args[1], "--tin") == 0 ? args[2] : NULL);
 		}
 	}
 
 	// Destroy window
 	SDL_DestroyWindow(window);
 
+	thread_pool_stop(thread_pool);
+
 	// Quit SDL subsystems
 	SDL_Quit();
 
@@ -456,5 +4223,5 @@ int main(int argc, char* args[])
 	}
 	delete[] pixelValues;
 
-	return 0;
+	return exit_code;
 }